@@ -13,7 +13,7 @@ Source0:        %{name}-%{version}.tar.gz
 BuildRoot:      %{_tmppath}/%{name}-%{version}-%{release}-root-%(id -u -n)
 
 BuildRequires:  libidn-devel
-BuildRequires:  libidn2-devel
+BuildRequires:  libidn2-devel >= 2.0.0
 Requires:  libidn
 Requires:  libidn2
 
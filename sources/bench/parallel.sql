@@ -0,0 +1,43 @@
+-- Parallel scaling benchmark for the idn extension.
+--
+-- Run against a scratch database with the extension installed:
+--
+--   psql -X -f bench/parallel.sql scratch
+--
+-- It builds a table of 2M names (about 1 in 10 an IDN), then runs the same
+-- conversion-heavy queries, from bench/parallel_run.sql, with 0, 1, 2, 4
+-- and 8 workers per gather node.
+-- Compare the timings (and the "Workers Launched" lines) between runs; the
+-- cluster's max_worker_processes and max_parallel_workers cap the scaling.
+
+\set ON_ERROR_STOP 1
+\timing off
+
+CREATE EXTENSION IF NOT EXISTS idn;
+
+DROP TABLE IF EXISTS idn_bench;
+CREATE TABLE idn_bench AS
+    SELECT CASE WHEN g % 10 = 0 THEN u&'b\00fccher' || g || '.de'
+                ELSE 'name' || g || '.example' END AS n
+    FROM generate_series(1, 2000000) AS g;
+VACUUM ANALYZE idn_bench;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET client_min_messages = error;
+
+\timing on
+
+\set workers 0
+\ir parallel_run.sql
+\set workers 1
+\ir parallel_run.sql
+\set workers 2
+\ir parallel_run.sql
+\set workers 4
+\ir parallel_run.sql
+\set workers 8
+\ir parallel_run.sql
+
+\timing off
+DROP TABLE idn_bench;
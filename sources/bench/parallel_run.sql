@@ -0,0 +1,7 @@
+-- One round of bench/parallel.sql, with :workers workers per gather node.
+
+SET max_parallel_workers_per_gather = :workers;
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF) SELECT count(idn2_lookup(n)) FROM idn_bench;
+SELECT count(idn2_lookup(n)) FROM idn_bench;
+SELECT count(idn2_to_unicode(idn2_lookup(n))) FROM idn_bench WHERE idn_classify(n) & 4 <> 0;
+SELECT count(DISTINCT idn_hash(n, 0)) FROM idn_bench;
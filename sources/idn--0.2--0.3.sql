@@ -0,0 +1,164 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "ALTER EXTENSION idn UPDATE TO '0.3'" to load this file. \quit
+
+-- see idn--0.3.sql for the reasoning behind PARALLEL SAFE and COST
+ALTER FUNCTION idn_utf8_nfkc_normalize(TEXT) PARALLEL SAFE COST 50;
+ALTER FUNCTION stringprep(TEXT, TEXT, TEXT) PARALLEL SAFE COST 100;
+ALTER FUNCTION idn_idna_decode(TEXT, TEXT) PARALLEL SAFE COST 100;
+ALTER FUNCTION idn_idna_encode(TEXT, TEXT) PARALLEL SAFE COST 100;
+ALTER FUNCTION idn_pr29_check(TEXT) PARALLEL SAFE COST 50;
+ALTER FUNCTION idn_punycode_encode(TEXT) PARALLEL SAFE COST 50;
+ALTER FUNCTION idn_punycode_decode(TEXT) PARALLEL SAFE COST 50;
+ALTER FUNCTION idn2_lookup(TEXT, TEXT) PARALLEL SAFE COST 100;
+ALTER FUNCTION idn2_register(TEXT, TEXT, TEXT) PARALLEL SAFE COST 100;
+ALTER FUNCTION idn_constants() PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION idn2_to_unicode(TEXT, TEXT DEFAULT NULL) returns TEXT LANGUAGE C IMMUTABLE PARALLEL SAFE COST 20 as 'MODULE_PATHNAME', 'libidn2_to_unicode';
+
+-- DNSSEC canonical ordering (RFC 4034, section 6.1)
+CREATE OR REPLACE FUNCTION idn_canonical_key(TEXT) returns BYTEA LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_canonical_cmp(TEXT, TEXT) returns INTEGER LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_canonical_lt(TEXT, TEXT) returns bool LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_canonical_le(TEXT, TEXT) returns bool LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_canonical_eq(TEXT, TEXT) returns bool LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_canonical_ne(TEXT, TEXT) returns bool LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_canonical_ge(TEXT, TEXT) returns bool LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_canonical_gt(TEXT, TEXT) returns bool LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_canonical_sortsupport(INTERNAL) returns VOID LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_hash(TEXT) returns INTEGER LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 10 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_hash(TEXT, INT8) returns INT8 LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 10 as 'MODULE_PATHNAME', 'idn_hash_extended';
+
+CREATE OPERATOR #<# (LEFTARG = TEXT, RIGHTARG = TEXT, PROCEDURE = idn_canonical_lt,
+    COMMUTATOR = #>#, NEGATOR = #>=#, RESTRICT = scalarltsel, JOIN = scalarltjoinsel);
+CREATE OPERATOR #<=# (LEFTARG = TEXT, RIGHTARG = TEXT, PROCEDURE = idn_canonical_le,
+    COMMUTATOR = #>=#, NEGATOR = #>#, RESTRICT = scalarltsel, JOIN = scalarltjoinsel);
+CREATE OPERATOR #=# (LEFTARG = TEXT, RIGHTARG = TEXT, PROCEDURE = idn_canonical_eq,
+    COMMUTATOR = #=#, NEGATOR = #<>#, RESTRICT = eqsel, JOIN = eqjoinsel, MERGES, HASHES);
+CREATE OPERATOR #<># (LEFTARG = TEXT, RIGHTARG = TEXT, PROCEDURE = idn_canonical_ne,
+    COMMUTATOR = #<>#, NEGATOR = #=#, RESTRICT = neqsel, JOIN = neqjoinsel);
+CREATE OPERATOR #>=# (LEFTARG = TEXT, RIGHTARG = TEXT, PROCEDURE = idn_canonical_ge,
+    COMMUTATOR = #<=#, NEGATOR = #<#, RESTRICT = scalargtsel, JOIN = scalargtjoinsel);
+CREATE OPERATOR #># (LEFTARG = TEXT, RIGHTARG = TEXT, PROCEDURE = idn_canonical_gt,
+    COMMUTATOR = #<#, NEGATOR = #<=#, RESTRICT = scalargtsel, JOIN = scalargtjoinsel);
+
+CREATE OPERATOR CLASS idn_canonical_ops FOR TYPE TEXT USING btree AS
+    OPERATOR 1 #<#,
+    OPERATOR 2 #<=#,
+    OPERATOR 3 #=#,
+    OPERATOR 4 #>=#,
+    OPERATOR 5 #>#,
+    FUNCTION 1 idn_canonical_cmp(TEXT, TEXT),
+    FUNCTION 2 idn_canonical_sortsupport(INTERNAL);
+
+CREATE OPERATOR CLASS idn_canonical_ops FOR TYPE TEXT USING hash AS
+    OPERATOR 1 #=#,
+    FUNCTION 1 idn_hash(TEXT),
+    FUNCTION 2 idn_hash(TEXT, INT8);
+
+-- statement-level maintenance of derived columns
+CREATE OR REPLACE FUNCTION idn_sync_columns() returns TRIGGER LANGUAGE C as 'MODULE_PATHNAME';
+
+-- cheap structural classification; see the IDN_CLASS_* constants
+CREATE OR REPLACE FUNCTION idn_classify(TEXT) returns INTEGER LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 2 as 'MODULE_PATHNAME';
+
+-- streaming conversion of a server-side file; superusers and pg_read_server_files only
+CREATE OR REPLACE FUNCTION idn_convert_file(TEXT, TEXT DEFAULT 'idn2_lookup', TEXT DEFAULT NULL)
+    returns TABLE(line_no INT8, input TEXT, output TEXT, rc INTEGER) LANGUAGE C VOLATILE PARALLEL RESTRICTED COST 100 as 'MODULE_PATHNAME';
+REVOKE ALL ON FUNCTION idn_convert_file(TEXT, TEXT, TEXT) FROM PUBLIC;
+
+-- UTS#46 processing; see the UTS46_FLAG_* constants
+CREATE OR REPLACE FUNCTION idn_uts46_lookup(TEXT, TEXT DEFAULT NULL) returns TEXT LANGUAGE C IMMUTABLE PARALLEL SAFE COST 100 as 'MODULE_PATHNAME';
+
+-- one-pass validation report; see the IDN_CHECK_* constants
+CREATE OR REPLACE FUNCTION idn_validation_accum(INTERNAL, TEXT) returns INTERNAL LANGUAGE C IMMUTABLE PARALLEL SAFE COST 100 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_validation_accum(INTERNAL, TEXT, TEXT) returns INTERNAL LANGUAGE C IMMUTABLE PARALLEL SAFE COST 100 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_validation_combine(INTERNAL, INTERNAL) returns INTERNAL LANGUAGE C IMMUTABLE PARALLEL SAFE as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_validation_serialize(INTERNAL) returns BYTEA LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_validation_deserialize(BYTEA, INTERNAL) returns INTERNAL LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_validation_final(INTERNAL) returns JSONB LANGUAGE C IMMUTABLE PARALLEL SAFE as 'MODULE_PATHNAME';
+
+CREATE AGGREGATE idn_validation_summary(TEXT) (
+    SFUNC = idn_validation_accum, STYPE = INTERNAL, FINALFUNC = idn_validation_final,
+    COMBINEFUNC = idn_validation_combine, SERIALFUNC = idn_validation_serialize,
+    DESERIALFUNC = idn_validation_deserialize, PARALLEL = SAFE);
+CREATE AGGREGATE idn_validation_summary(TEXT, TEXT) (
+    SFUNC = idn_validation_accum, STYPE = INTERNAL, FINALFUNC = idn_validation_final,
+    COMBINEFUNC = idn_validation_combine, SERIALFUNC = idn_validation_serialize,
+    DESERIALFUNC = idn_validation_deserialize, PARALLEL = SAFE);
+
+-- approximate distinct counts of canonical names; sketches are mergeable BYTEA values
+CREATE OR REPLACE FUNCTION idn_hll_add(BYTEA, TEXT) returns BYTEA LANGUAGE C IMMUTABLE PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_hll_union(BYTEA, BYTEA) returns BYTEA LANGUAGE C IMMUTABLE PARALLEL SAFE COST 10 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_hll_cardinality(BYTEA) returns INT8 LANGUAGE C IMMUTABLE PARALLEL SAFE COST 10 as 'MODULE_PATHNAME';
+
+CREATE AGGREGATE idn_hll_sketch(TEXT) (
+    SFUNC = idn_hll_add, STYPE = BYTEA, SSPACE = 4102,
+    COMBINEFUNC = idn_hll_union, PARALLEL = SAFE);
+CREATE AGGREGATE idn_approx_distinct(TEXT) (
+    SFUNC = idn_hll_add, STYPE = BYTEA, SSPACE = 4102, FINALFUNC = idn_hll_cardinality,
+    COMBINEFUNC = idn_hll_union, PARALLEL = SAFE);
+CREATE AGGREGATE idn_hll_merge(BYTEA) (
+    SFUNC = idn_hll_union, STYPE = BYTEA, SSPACE = 4102,
+    COMBINEFUNC = idn_hll_union, PARALLEL = SAFE);
+
+-- online backfill of converted columns by a background worker
+CREATE TABLE idn_backfill_jobs (
+    job_id SERIAL PRIMARY KEY,
+    relid REGCLASS NOT NULL,
+    source_column NAME NOT NULL,
+    target_column NAME NOT NULL,
+    operation TEXT NOT NULL,
+    flags TEXT,
+    batch_pages INTEGER NOT NULL CHECK (batch_pages > 0),
+    batch_delay_ms INTEGER NOT NULL CHECK (batch_delay_ms >= 0),
+    owner REGROLE NOT NULL,
+    status TEXT NOT NULL DEFAULT 'pending'
+        CHECK (status IN ('pending', 'running', 'done', 'cancelled', 'failed')),
+    worker_pid INTEGER,
+    next_block INT8 NOT NULL DEFAULT 0,
+    total_blocks INT8,
+    rows_updated INT8 NOT NULL DEFAULT 0,
+    rows_failed INT8 NOT NULL DEFAULT 0,
+    error TEXT,
+    created_at TIMESTAMPTZ NOT NULL DEFAULT now(),
+    started_at TIMESTAMPTZ,
+    updated_at TIMESTAMPTZ,
+    finished_at TIMESTAMPTZ
+);
+SELECT pg_catalog.pg_extension_config_dump('idn_backfill_jobs', '');
+SELECT pg_catalog.pg_extension_config_dump('idn_backfill_jobs_job_id_seq', '');
+
+-- a running job whose worker has gone away (e.g. after a restart) shows as interrupted
+CREATE VIEW idn_backfill_progress AS
+    SELECT j.job_id, j.relid, j.source_column, j.target_column, j.operation,
+           CASE WHEN j.status = 'running' AND NOT EXISTS (
+                    SELECT 1 FROM pg_catalog.pg_stat_activity a WHERE a.pid = j.worker_pid)
+                THEN 'interrupted' ELSE j.status END AS status,
+           j.next_block AS blocks_done, j.total_blocks,
+           CASE WHEN j.status = 'done' THEN 100.0
+                ELSE round(100.0 * j.next_block / nullif(j.total_blocks, 0), 1) END AS percent_done,
+           j.rows_updated, j.rows_failed, j.started_at, j.updated_at, j.finished_at, j.error
+    FROM idn_backfill_jobs j;
+
+CREATE OR REPLACE FUNCTION idn_backfill_start(REGCLASS, NAME, NAME, TEXT DEFAULT 'idn2_lookup', TEXT DEFAULT NULL,
+                                              batch_pages INTEGER DEFAULT 100, batch_delay_ms INTEGER DEFAULT 100)
+    returns INTEGER LANGUAGE C VOLATILE as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_backfill_resume(INTEGER) returns BOOLEAN LANGUAGE C STRICT VOLATILE as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_backfill_cancel(INTEGER) returns BOOLEAN LANGUAGE C STRICT VOLATILE as 'MODULE_PATHNAME';
+-- not SECURITY DEFINER: a role granted these also needs SELECT, INSERT and UPDATE on idn_backfill_jobs
+REVOKE ALL ON FUNCTION idn_backfill_start(REGCLASS, NAME, NAME, TEXT, TEXT, INTEGER, INTEGER) FROM PUBLIC;
+REVOKE ALL ON FUNCTION idn_backfill_resume(INTEGER) FROM PUBLIC;
+REVOKE ALL ON FUNCTION idn_backfill_cancel(INTEGER) FROM PUBLIC;
+
+-- brand matching: positions in the pattern array of the patterns found in the name
+CREATE OR REPLACE FUNCTION idn_brand_match(TEXT, TEXT[]) returns INTEGER[] LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE COST 50 as 'MODULE_PATHNAME';
+
+-- typosquatting candidates as A-label names; see the IDN_VARIANT_* constants
+CREATE OR REPLACE FUNCTION idn_variants(TEXT, TEXT DEFAULT NULL)
+    returns TABLE(variant TEXT, kind TEXT) LANGUAGE C IMMUTABLE PARALLEL SAFE COST 1000 ROWS 300 as 'MODULE_PATHNAME';
+
+-- email addresses: convert the domain after the last '@'; array forms return NULL elements for failures
+CREATE OR REPLACE FUNCTION idn_email_to_ascii(TEXT, TEXT DEFAULT NULL) returns TEXT LANGUAGE C IMMUTABLE PARALLEL SAFE COST 100 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_email_to_unicode(TEXT, TEXT DEFAULT NULL) returns TEXT LANGUAGE C IMMUTABLE PARALLEL SAFE COST 20 as 'MODULE_PATHNAME';
+CREATE OR REPLACE FUNCTION idn_email_to_ascii(TEXT[], TEXT DEFAULT NULL) returns TEXT[] LANGUAGE C IMMUTABLE PARALLEL SAFE COST 100 as 'MODULE_PATHNAME', 'idn_email_to_ascii_array';
+CREATE OR REPLACE FUNCTION idn_email_to_unicode(TEXT[], TEXT DEFAULT NULL) returns TEXT[] LANGUAGE C IMMUTABLE PARALLEL SAFE COST 20 as 'MODULE_PATHNAME', 'idn_email_to_unicode_array';
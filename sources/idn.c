@@ -35,10 +35,45 @@
 #include "fmgr.h"
 #include "catalog/pg_type.h"
 #include "funcapi.h"
-// #include "miscadmin.h"
+#include "miscadmin.h"
 #include "utils/builtins.h"
 #include "utils/palloc.h"
 #include "mb/pg_wchar.h"
+#include "pgstat.h"
+#include "access/hash.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_trigger.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "lib/hyperloglog.h"
+#include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
+#include "port/pg_bswap.h"
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/procarray.h"
+#include "tcop/tcopprot.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/datum.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/sortsupport.h"
+#include "utils/tuplestore.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <unistd.h>
 
 /* libidn includes */
 #include <stringprep.h>
@@ -49,19 +84,51 @@
 /* libidn2 includes */
 #include <idn2.h>
 
+/* UTS#46 processing (IDN2_TRANSITIONAL and friends) arrived in libidn2 2.0 */
+#if !defined(IDN2_VERSION_NUMBER) || IDN2_VERSION_NUMBER < 0x02000000
+#error "libidn2 2.0.0 or later is required"
+#endif
+
 PG_MODULE_MAGIC;
 void _PG_init(void);
 void _PG_fini(void);
 
 static short stringprep_version_bad = 0;
+static void classify_init(void);
 
 enum constant_scope {
     SCOPE_STRINGPREP = 1, /* start at 1 */
     SCOPE_IDNA,
     SCOPE_IDNA2,
     SCOPE_PUNYCODE, /* unused at the moment */
+    SCOPE_CLASSIFY,
+    SCOPE_UTS46,
+    SCOPE_VALIDATE,
+    SCOPE_VARIANT,
 };
 
+/* idn_classify result bits */
+#define IDN_CLASS_LDH       0x01
+#define IDN_CLASS_ALABEL    0x02
+#define IDN_CLASS_ULABEL    0x04
+#define IDN_CLASS_INVALID   0x08
+#define IDN_CLASS_NON_LDH   0x10
+
+/* idn_validation_summary checks */
+#define IDN_CHECK_PR29              0x01
+#define IDN_CHECK_IDNA2003          0x02
+#define IDN_CHECK_IDNA2008_LOOKUP   0x04
+#define IDN_CHECK_IDNA2008_REGISTER 0x08
+#define IDN_CHECK_NFKC              0x10
+
+/* idn_variants kinds */
+#define IDN_VARIANT_OMISSION      0x01
+#define IDN_VARIANT_INSERTION     0x02
+#define IDN_VARIANT_TRANSPOSITION 0x04
+#define IDN_VARIANT_ADJACENT_KEY  0x08
+#define IDN_VARIANT_HOMOGLYPH     0x10
+#define IDN_VARIANT_SCRIPT_SWAP   0x20
+
 struct idn_constants_struct {
     enum constant_scope scope;
     const char *name;
@@ -133,6 +200,150 @@ static struct idn_constants_struct _constants[] = {
         .value = IDN2_ALABEL_ROUNDTRIP,
         .description = "Apply additional round-trip conversion of A-label inputs.",
     },
+    {
+        .scope = SCOPE_IDNA2,
+        .name = "IDN2_FLAG_TRANSITIONAL",
+        .value = IDN2_TRANSITIONAL,
+        .description = "Perform Unicode TR46 transitional processing.",
+    },
+    {
+        .scope = SCOPE_IDNA2,
+        .name = "IDN2_FLAG_NONTRANSITIONAL",
+        .value = IDN2_NONTRANSITIONAL,
+        .description = "Perform Unicode TR46 non-transitional processing.",
+    },
+    {
+        .scope = SCOPE_IDNA2,
+        .name = "IDN2_FLAG_USE_STD3_ASCII_RULES",
+        .value = IDN2_USE_STD3_ASCII_RULES,
+        .description = "Use STD3 ASCII rules (only meaningful with TR46 processing).",
+    },
+    {
+        .scope = SCOPE_IDNA2,
+        .name = "IDN2_FLAG_NO_TR46",
+        .value = IDN2_NO_TR46,
+        .description = "Disable Unicode TR46 processing.",
+    },
+    {
+        .scope = SCOPE_UTS46,
+        .name = "UTS46_FLAG_NONE",
+        .value = 0,
+        .description = "A value representing no flags supplied (non-transitional processing).",
+    },
+    {
+        .scope = SCOPE_UTS46,
+        .name = "UTS46_FLAG_TRANSITIONAL",
+        .value = IDN2_TRANSITIONAL,
+        .description = "Transitional processing: deviation characters such as U+00DF are mapped (to \"ss\").",
+    },
+    {
+        .scope = SCOPE_UTS46,
+        .name = "UTS46_FLAG_NONTRANSITIONAL",
+        .value = IDN2_NONTRANSITIONAL,
+        .description = "Non-transitional processing: deviation characters are kept. This is the default.",
+    },
+    {
+        .scope = SCOPE_UTS46,
+        .name = "UTS46_FLAG_USE_STD3_ASCII_RULES",
+        .value = IDN2_USE_STD3_ASCII_RULES,
+        .description = "Disallow ASCII characters other than letters, digits and hyphens.",
+    },
+    {
+        .scope = SCOPE_CLASSIFY,
+        .name = "IDN_CLASS_LDH",
+        .value = IDN_CLASS_LDH,
+        .description = "The name consists only of ASCII letters, digits, hyphens and dots.",
+    },
+    {
+        .scope = SCOPE_CLASSIFY,
+        .name = "IDN_CLASS_ALABEL",
+        .value = IDN_CLASS_ALABEL,
+        .description = "At least one label starts with the ACE prefix \"xn--\".",
+    },
+    {
+        .scope = SCOPE_CLASSIFY,
+        .name = "IDN_CLASS_ULABEL",
+        .value = IDN_CLASS_ULABEL,
+        .description = "The name contains non-ASCII characters.",
+    },
+    {
+        .scope = SCOPE_CLASSIFY,
+        .name = "IDN_CLASS_INVALID",
+        .value = IDN_CLASS_INVALID,
+        .description = "The name is empty, has an empty label, a label longer than 63 bytes, or is longer than 253 bytes.",
+    },
+    {
+        .scope = SCOPE_CLASSIFY,
+        .name = "IDN_CLASS_NON_LDH",
+        .value = IDN_CLASS_NON_LDH,
+        .description = "The name contains ASCII characters other than letters, digits, hyphens and dots (e.g. underscores).",
+    },
+    {
+        .scope = SCOPE_VALIDATE,
+        .name = "IDN_CHECK_PR29",
+        .value = IDN_CHECK_PR29,
+        .description = "The name passes the PR29 check (see idn_pr29_check).",
+    },
+    {
+        .scope = SCOPE_VALIDATE,
+        .name = "IDN_CHECK_IDNA2003",
+        .value = IDN_CHECK_IDNA2003,
+        .description = "The name converts with IDNA2003 ToASCII (see idn_idna_encode).",
+    },
+    {
+        .scope = SCOPE_VALIDATE,
+        .name = "IDN_CHECK_IDNA2008_LOOKUP",
+        .value = IDN_CHECK_IDNA2008_LOOKUP,
+        .description = "The name converts with IDNA2008 lookup (see idn2_lookup).",
+    },
+    {
+        .scope = SCOPE_VALIDATE,
+        .name = "IDN_CHECK_IDNA2008_REGISTER",
+        .value = IDN_CHECK_IDNA2008_REGISTER,
+        .description = "Every label of the name converts with IDNA2008 register (see idn2_register).",
+    },
+    {
+        .scope = SCOPE_VALIDATE,
+        .name = "IDN_CHECK_NFKC",
+        .value = IDN_CHECK_NFKC,
+        .description = "The name is unchanged by NFKC normalization.",
+    },
+    {
+        .scope = SCOPE_VARIANT,
+        .name = "IDN_VARIANT_OMISSION",
+        .value = IDN_VARIANT_OMISSION,
+        .description = "Drop one character.",
+    },
+    {
+        .scope = SCOPE_VARIANT,
+        .name = "IDN_VARIANT_INSERTION",
+        .value = IDN_VARIANT_INSERTION,
+        .description = "Insert one letter, digit or hyphen.",
+    },
+    {
+        .scope = SCOPE_VARIANT,
+        .name = "IDN_VARIANT_TRANSPOSITION",
+        .value = IDN_VARIANT_TRANSPOSITION,
+        .description = "Swap two adjacent characters.",
+    },
+    {
+        .scope = SCOPE_VARIANT,
+        .name = "IDN_VARIANT_ADJACENT_KEY",
+        .value = IDN_VARIANT_ADJACENT_KEY,
+        .description = "Replace one letter or digit with a neighbouring key on a QWERTY keyboard.",
+    },
+    {
+        .scope = SCOPE_VARIANT,
+        .name = "IDN_VARIANT_HOMOGLYPH",
+        .value = IDN_VARIANT_HOMOGLYPH,
+        .description = "Replace one character with a look-alike (e.g. Cyrillic a for Latin a, 0 for o).",
+    },
+    {
+        .scope = SCOPE_VARIANT,
+        .name = "IDN_VARIANT_SCRIPT_SWAP",
+        .value = IDN_VARIANT_SCRIPT_SWAP,
+        .description = "Spell the whole label with look-alikes from another script (Latin, Cyrillic or Greek).",
+    },
 };
 
 static int
@@ -150,6 +361,10 @@ constants_compare(const void *p1, const void *p2)
     return pg_strcasecmp(a->name, b->name);
 }
 
+/* Everything set up here is per-process: parallel workers load the
+ * library and run _PG_init for themselves, so nothing is shared with
+ * (or sorted underneath) the leader.
+ */
 void _PG_init(void)
 {
     /* sort constants */
@@ -161,6 +376,8 @@ void _PG_init(void)
     if (!stringprep_check_version(STRINGPREP_VERSION)) {
         stringprep_version_bad = 1;
     }
+
+    classify_init();
 }
 
 /* this is never called anyway, but it's good practice */
@@ -249,9 +466,136 @@ ascii_check(const uint8_t *src, size_t slen)
     return true;
 }
 
+/* true if no byte has the high bit set; every server encoding agrees with
+ * UTF-8 (and with every other server encoding) on such strings
+ */
+static bool
+all_ascii(const char *src, size_t srclen)
+{
+    size_t i;
+
+    for (i = 0; i < srclen; ++i) {
+        if (IS_HIGHBIT_SET(src[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Conversion between the database encoding and UTF-8.
+ *
+ * pg_do_encoding_conversion looks up the default conversion procedure and
+ * sets up a call to it on every call. The database encoding never changes
+ * within a backend, so each direction is looked up once, on first use, and
+ * its output buffer is kept for the next call. Outputs too large to be
+ * worth keeping are palloc()ed instead.
+ */
+#define CONVERSION_BUFFER_KEEP (64 * 1024)
+
+struct conversion_cache {
+    int src_encoding;
+    int dest_encoding;
+    bool resolved;
+    FmgrInfo proc;
+    char *buf; /* in TopMemoryContext */
+    size_t buflen;
+};
+
+static struct conversion_cache to_utf8_cache, from_utf8_cache;
+
+/* returns src itself if no conversion is needed (not NUL-terminated,
+ * then), else the NUL-terminated result in cc's buffer, which is only
+ * good until the next conversion in the same direction, or in palloc()ed
+ * memory if *palloced
+ */
+static char *
+encoding_convert(struct conversion_cache *cc, int src_encoding, int dest_encoding,
+                 const char *src, size_t srclen, size_t *destlen, bool *palloced)
+{
+    char *dest;
+    size_t needed;
+
+    *palloced = false;
+    *destlen = srclen;
+
+    /* the same shortcuts as pg_do_encoding_conversion, plus pure ASCII */
+    if (src_encoding == dest_encoding || dest_encoding == PG_SQL_ASCII || all_ascii(src, srclen)) {
+        return (char *) src;
+    }
+    if (src_encoding == PG_SQL_ASCII) {
+        /* nothing to convert, but the bytes have to be valid in the destination */
+        (void) pg_verify_mbstr(dest_encoding, src, srclen, false);
+        return (char *) src;
+    }
+
+    if (!cc->resolved || cc->src_encoding != src_encoding || cc->dest_encoding != dest_encoding) {
+        Oid proc = FindDefaultConversionProc(src_encoding, dest_encoding);
+
+        if (!OidIsValid(proc)) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_UNDEFINED_FUNCTION),
+                     errmsg("default conversion function for encoding \"%s\" to \"%s\" does not exist",
+                            pg_encoding_to_char(src_encoding),
+                            pg_encoding_to_char(dest_encoding))));
+        }
+        cc->resolved = false;
+        fmgr_info_cxt(proc, &cc->proc, TopMemoryContext);
+        cc->src_encoding = src_encoding;
+        cc->dest_encoding = dest_encoding;
+        cc->resolved = true;
+    }
+
+    if (srclen >= MaxAllocSize / (Size) MAX_CONVERSION_GROWTH) {
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("out of memory"),
+                 errdetail("String of %d bytes is too long for encoding conversion.",
+                           (int) srclen)));
+    }
+    needed = srclen * MAX_CONVERSION_GROWTH + 1;
+
+    if (needed > CONVERSION_BUFFER_KEEP) {
+        dest = palloc(needed);
+        *palloced = true;
+    } else {
+        if (cc->buflen < needed) {
+            size_t newlen = Max(cc->buflen * 2, 1024);
+
+            while (newlen < needed) {
+                newlen *= 2;
+            }
+            newlen = Min(newlen, CONVERSION_BUFFER_KEEP);
+            if (cc->buf) {
+                pfree(cc->buf);
+                cc->buf = NULL;
+                cc->buflen = 0;
+            }
+            cc->buf = MemoryContextAlloc(TopMemoryContext, newlen);
+            cc->buflen = newlen;
+        }
+        dest = cc->buf;
+    }
+
+    FunctionCall5(&cc->proc,
+                  Int32GetDatum(src_encoding),
+                  Int32GetDatum(dest_encoding),
+                  CStringGetDatum(src),
+                  CStringGetDatum(dest),
+                  Int32GetDatum((int32) srclen));
+
+    *destlen = strlen(dest);
+    return dest;
+}
+
 /* convert a TEXT argument to UTF-8
  * If the database encoding is SQL_ASCII, the contents are
  * simply validated (based upon comments found in src/backend/utils/mb/mbutils.c
+ *
+ * force_new makes the result NUL-terminated, but not necessarily the
+ * caller's own: unless *needs_free is set, it is either the argument's
+ * data (without force_new) or a converted result in a buffer shared with
+ * the next call, even with force_new. Such a result must not be freed or
+ * kept, and a caller must be done with it before asking for another.
  */
 static char *text_to_utf8(text *arg, size_t *utf8_srclen, bool *needs_free, bool force_new)
 {
@@ -262,23 +606,16 @@ static char *text_to_utf8(text *arg, size_t *utf8_srclen, bool *needs_free, bool
     srclen = VARSIZE_ANY_EXHDR(arg);
 
     /* we /may/ need to convert from (whatever encoding the db is in) to UTF-8 */
-    utf8_src = (char *) pg_do_encoding_conversion((unsigned char *) src, srclen, GetDatabaseEncoding(), PG_UTF8);
+    utf8_src = encoding_convert(&to_utf8_cache, GetDatabaseEncoding(), PG_UTF8,
+                                src, srclen, utf8_srclen, needs_free);
 
     /* if utf8_src == src, no conversion happened, otherwise
     * the returned string is NULL-terminated
     */
-    if (utf8_src == src) {
-        if (force_new) {
-            utf8_src = palloc(srclen + 1);
-            memcpy(utf8_src, src, srclen);
-            utf8_src[srclen] = '\0';
-            *needs_free = true;
-        } else {
-            *needs_free = false;
-        }
-        *utf8_srclen = srclen;
-    } else {
-        *utf8_srclen = strlen(utf8_src);
+    if (utf8_src == src && force_new) {
+        utf8_src = palloc(srclen + 1);
+        memcpy(utf8_src, src, srclen);
+        utf8_src[srclen] = '\0';
         *needs_free = true;
     }
     return utf8_src;
@@ -288,22 +625,17 @@ static text *utf8_to_text(char *src, size_t srclen)
 {
     char *dest;
     size_t destlen;
+    bool palloced;
     text *ret;
 
     /* src is in UTF-8, but the db might not be */
-    dest = (char *) pg_do_encoding_conversion((unsigned char *) src, srclen, PG_UTF8, GetDatabaseEncoding());
-
-    /* if dest == src, that means no conversion took place */
-    if (dest == src) {
-        destlen = srclen;
-    } else {
-        destlen = strlen(dest);
-    }
+    dest = encoding_convert(&from_utf8_cache, PG_UTF8, GetDatabaseEncoding(),
+                            src, srclen, &destlen, &palloced);
 
     ret = cstring_to_text_with_len(dest, destlen);
 
     /* we are done with dest. may need to deallocate */
-    if (dest != src) {
+    if (palloced) {
         pfree(dest);
     }
     return ret;
@@ -812,6 +1144,28 @@ Datum idn_pr29_check(PG_FUNCTION_ARGS)
     PG_RETURN_BOOL(ret == PR29_SUCCESS);
 }
 
+/* libidn2 2.0 applies UTS#46 non-transitional processing by default;
+ * keep plain IDNA2008 unless a TR46 mode was asked for
+ */
+static int
+idna2008_flags(int flags)
+{
+    if (!(flags & (IDN2_TRANSITIONAL | IDN2_NONTRANSITIONAL))) {
+        flags |= IDN2_NO_TR46;
+    }
+    return flags;
+}
+
+/* UTS#46 defaults to non-transitional processing */
+static int
+uts46_flags(int flags)
+{
+    if (!(flags & (IDN2_TRANSITIONAL | IDN2_NONTRANSITIONAL))) {
+        flags |= IDN2_NONTRANSITIONAL;
+    }
+    return flags;
+}
+
 Datum libidn2_lookup(PG_FUNCTION_ARGS);
 /*
 Perform IDNA2008 lookup string conversion on domain name src, as described in section 5 of RFC 5891.
@@ -846,7 +1200,7 @@ Datum libidn2_lookup(PG_FUNCTION_ARGS)
 
     utf8_src = (uint8_t *) text_to_utf8(arg0, &utf8_srclen, &needs_free, true);
 
-    rc = idn2_lookup_u8(utf8_src, &lookupname, flags);
+    rc = idn2_lookup_u8(utf8_src, &lookupname, idna2008_flags(flags));
 
     if (needs_free) {
         pfree(utf8_src);
@@ -1014,3 +1368,4408 @@ Datum idn_constants(PG_FUNCTION_ARGS)
     }
     SRF_RETURN_DONE(funcctx);
 }
+
+/*
+ * DNSSEC canonical ordering (RFC 4034, section 6.1).
+ *
+ * Names are converted to their IDNA2008 lookup (A-label) form, case-folded,
+ * and the labels are written out right-to-left, each one followed by a NUL
+ * byte. A plain memcmp() of two such keys gives the canonical order: a
+ * label that is a prefix of another sorts first because NUL sorts below
+ * every byte a label can contain, and a name sorts before its subdomains.
+ */
+
+#ifndef DatumBigEndianToNative
+#ifdef WORDS_BIGENDIAN
+#define DatumBigEndianToNative(x) (x)
+#elif SIZEOF_DATUM == 8
+#define DatumBigEndianToNative(x) pg_bswap64(x)
+#else
+#define DatumBigEndianToNative(x) pg_bswap32(x)
+#endif
+#endif
+
+/* return the A-label form of a UTF-8 name, minus any trailing root dot.
+ * Pure ASCII input is passed through untouched (the caller case-folds);
+ * anything else goes through UTS#46 lookup, in which case *malloced
+ * is set and the result must be released with free().
+ * If the conversion fails, rc is set and the input itself is returned,
+ * so that callers which need a total order can still use it.
+ */
+static const char *
+canonical_alabel(const char *utf8_src, size_t utf8_srclen, size_t *alabel_len, bool *malloced, int *rc)
+{
+    const char *res = utf8_src;
+    size_t reslen = utf8_srclen;
+
+    *malloced = false;
+    *rc = IDN2_OK;
+
+    if (!ascii_check((const uint8_t *) utf8_src, utf8_srclen)) {
+        char *nul_src;
+        uint8_t *lookupname;
+
+        /* idn2_lookup_u8 requires a NUL-terminated input */
+        nul_src = palloc(utf8_srclen + 1);
+        memcpy(nul_src, utf8_src, utf8_srclen);
+        nul_src[utf8_srclen] = '\0';
+
+        /* UTS#46 mapping folds case (and width) outside ASCII too, so
+         * that upper- and lower-case U-labels share a key
+         */
+        *rc = idn2_lookup_u8((uint8_t *) nul_src, &lookupname, uts46_flags(0));
+        pfree(nul_src);
+
+        if (*rc == IDN2_OK) {
+            res = (const char *) lookupname;
+            reslen = strlen(res);
+            *malloced = true;
+        }
+    }
+
+    /* "example.com." and "example.com" are the same name */
+    if (reslen > 0 && res[reslen - 1] == '.') {
+        reslen--;
+    }
+
+    *alabel_len = reslen;
+    return res;
+}
+
+/* append the canonical sort key of 'arg' to 'buf', returning the
+ * rc of the A-label conversion. On failure, the key is built from
+ * the (case-folded) input instead.
+ */
+static int
+canonical_key_append(text *arg, StringInfo buf)
+{
+    char *utf8_src;
+    size_t utf8_srclen;
+    bool needs_free, malloced;
+    const char *name, *label, *label_end, *q;
+    size_t namelen;
+    char *d;
+    int rc;
+
+    utf8_src = text_to_utf8(arg, &utf8_srclen, &needs_free, false);
+
+    name = canonical_alabel(utf8_src, utf8_srclen, &namelen, &malloced, &rc);
+
+    /* every label gets a terminator, and there is one more label than
+     * there are dots, so the key is exactly one byte longer than the name.
+     * The empty (root) name has no labels at all.
+     */
+    if (namelen > 0) {
+        enlargeStringInfo(buf, namelen + 1);
+        d = buf->data + buf->len;
+
+        label_end = name + namelen;
+        for (;;) {
+            label = label_end;
+            while (label > name && label[-1] != '.') {
+                label--;
+            }
+            for (q = label; q < label_end; ++q) {
+                *d++ = pg_ascii_tolower((unsigned char) *q);
+            }
+            *d++ = '\0';
+            if (label == name) {
+                break;
+            }
+            label_end = label - 1;
+        }
+
+        buf->len += namelen + 1;
+        buf->data[buf->len] = '\0';
+    }
+
+    if (malloced) {
+        free((void *) name);
+    }
+    if (needs_free) {
+        pfree(utf8_src);
+    }
+    return rc;
+}
+
+static int
+canonical_key_compare(const char *a, int alen, const char *b, int blen)
+{
+    int res;
+
+    res = memcmp(a, b, Min(alen, blen));
+    if (res == 0 && alen != blen) {
+        res = (alen < blen) ? -1 : 1;
+    }
+    return res;
+}
+
+static int
+canonical_compare(text *arg0, text *arg1)
+{
+    StringInfoData a, b;
+    int res;
+
+    initStringInfo(&a);
+    initStringInfo(&b);
+    canonical_key_append(arg0, &a);
+    canonical_key_append(arg1, &b);
+
+    res = canonical_key_compare(a.data, a.len, b.data, b.len);
+
+    pfree(a.data);
+    pfree(b.data);
+    return res;
+}
+
+Datum idn_canonical_key(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_key);
+Datum idn_canonical_key(PG_FUNCTION_ARGS)
+{
+    StringInfoData buf;
+    bytea *result;
+    int rc;
+
+    if (PG_NARGS() != 1) {
+        elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+    /* while the function is defined as strict, this belts-and-suspenders
+     * doesn't hurt
+     */
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+
+    initStringInfo(&buf);
+    rc = canonical_key_append(PG_GETARG_TEXT_PP(0), &buf);
+
+    if (rc != IDN2_OK) {
+        pfree(buf.data);
+        ereport(WARNING,
+                (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+                 errmsg_internal("Error encountered performing UTS#46 lookup: %s",
+                                 idn2_strerror(rc))));
+        PG_RETURN_NULL();
+    }
+
+    result = palloc(VARHDRSZ + buf.len);
+    SET_VARSIZE(result, VARHDRSZ + buf.len);
+    memcpy(VARDATA(result), buf.data, buf.len);
+    pfree(buf.data);
+
+    PG_RETURN_BYTEA_P(result);
+}
+
+/* compare the two arguments of an operator or support function,
+ * releasing detoasted copies
+ */
+static int
+canonical_compare_args(FunctionCallInfo fcinfo)
+{
+    text *arg0 = PG_GETARG_TEXT_PP(0);
+    text *arg1 = PG_GETARG_TEXT_PP(1);
+    int res = canonical_compare(arg0, arg1);
+
+    PG_FREE_IF_COPY(arg0, 0);
+    PG_FREE_IF_COPY(arg1, 1);
+    return res;
+}
+
+/* btree support function 1 for idn_canonical_ops.
+ * Names which cannot be converted are ordered by their case-folded
+ * input rather than raising an error, so that the order stays total.
+ */
+Datum idn_canonical_cmp(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_cmp);
+Datum idn_canonical_cmp(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT32(canonical_compare_args(fcinfo));
+}
+
+Datum idn_canonical_lt(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_lt);
+Datum idn_canonical_lt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(canonical_compare_args(fcinfo) < 0);
+}
+
+Datum idn_canonical_le(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_le);
+Datum idn_canonical_le(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(canonical_compare_args(fcinfo) <= 0);
+}
+
+Datum idn_canonical_eq(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_eq);
+Datum idn_canonical_eq(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(canonical_compare_args(fcinfo) == 0);
+}
+
+Datum idn_canonical_ne(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_ne);
+Datum idn_canonical_ne(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(canonical_compare_args(fcinfo) != 0);
+}
+
+Datum idn_canonical_ge(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_ge);
+Datum idn_canonical_ge(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(canonical_compare_args(fcinfo) >= 0);
+}
+
+Datum idn_canonical_gt(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_gt);
+Datum idn_canonical_gt(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_BOOL(canonical_compare_args(fcinfo) > 0);
+}
+
+/* sortsupport state for idn_canonical_ops.
+ * Pure ASCII names never reach libidn2, but the key of any other name
+ * costs a full UTS#46 lookup. A sort compares the same value against
+ * many others in a row (the pivot, the current run head), so, like
+ * varstr_cmp in the core server, the last input on each side is kept
+ * along with its key and reused while it repeats.
+ */
+typedef struct {
+    StringInfoData buf1; /* reused key buffers */
+    StringInfoData buf2;
+    StringInfoData last1; /* the inputs whose keys are in buf1 and buf2 */
+    StringInfoData last2;
+    bool last1_valid;
+    bool last2_valid;
+    hyperLogLogState abbr_card; /* cardinality estimate of abbreviated keys */
+    int64 input_count;
+    bool estimating;
+} CanonicalSortSupport;
+
+/* make 'key' hold the canonical key of 'arg', unless it already does */
+static void
+canonical_cached_key(text *arg, StringInfo last, bool *last_valid, StringInfo key)
+{
+    const char *data = VARDATA_ANY(arg);
+    int len = VARSIZE_ANY_EXHDR(arg);
+
+    if (*last_valid && last->len == len && memcmp(last->data, data, len) == 0) {
+        return;
+    }
+    *last_valid = false;
+    resetStringInfo(key);
+    canonical_key_append(arg, key);
+    resetStringInfo(last);
+    appendBinaryStringInfo(last, data, len);
+    *last_valid = true;
+}
+
+static int
+canonical_fastcmp(Datum x, Datum y, SortSupport ssup)
+{
+    CanonicalSortSupport *css = (CanonicalSortSupport *) ssup->ssup_extra;
+    text *arg0 = DatumGetTextPP(x);
+    text *arg1 = DatumGetTextPP(y);
+    int res;
+
+    canonical_cached_key(arg0, &css->last1, &css->last1_valid, &css->buf1);
+    canonical_cached_key(arg1, &css->last2, &css->last2_valid, &css->buf2);
+
+    res = canonical_key_compare(css->buf1.data, css->buf1.len,
+                                css->buf2.data, css->buf2.len);
+
+    /* we can't afford to leak memory here */
+    if ((Pointer) arg0 != DatumGetPointer(x)) {
+        pfree(arg0);
+    }
+    if ((Pointer) arg1 != DatumGetPointer(y)) {
+        pfree(arg1);
+    }
+    return res;
+}
+
+/* abbreviated keys are the first sizeof(Datum) bytes of the canonical
+ * key, arranged so that an unsigned integer comparison matches memcmp()
+ */
+static int
+canonical_abbrev_cmp(Datum x, Datum y, SortSupport ssup)
+{
+    if (x > y) {
+        return 1;
+    } else if (x == y) {
+        return 0;
+    }
+    return -1;
+}
+
+static Datum
+canonical_abbrev_convert(Datum original, SortSupport ssup)
+{
+    CanonicalSortSupport *css = (CanonicalSortSupport *) ssup->ssup_extra;
+    text *arg = DatumGetTextPP(original);
+    Datum res;
+    uint32 hash;
+
+    css->last1_valid = false;
+    resetStringInfo(&css->buf1);
+    canonical_key_append(arg, &css->buf1);
+
+    /* short keys are zero-padded; ties are resolved by the full comparator */
+    res = (Datum) 0;
+    memcpy(&res, css->buf1.data, Min(css->buf1.len, sizeof(Datum)));
+    res = DatumBigEndianToNative(res);
+
+    if (css->estimating) {
+#if SIZEOF_DATUM == 8
+        uint32 lohalf = (uint32) res;
+        uint32 hihalf = (uint32) (res >> 32);
+
+        hash = DatumGetUInt32(hash_uint32(lohalf ^ hihalf));
+#else
+        hash = DatumGetUInt32(hash_uint32((uint32) res));
+#endif
+        addHyperLogLog(&css->abbr_card, hash);
+    }
+    css->input_count += 1;
+
+    if ((Pointer) arg != DatumGetPointer(original)) {
+        pfree(arg);
+    }
+    return res;
+}
+
+/* give up on abbreviation if the leading bytes are mostly shared,
+ * e.g. a table which is nothing but names under a single TLD.
+ * This follows the heuristic used for numeric in the core server.
+ */
+static bool
+canonical_abbrev_abort(int memtupcount, SortSupport ssup)
+{
+    CanonicalSortSupport *css = (CanonicalSortSupport *) ssup->ssup_extra;
+    double abbr_card;
+
+    if (memtupcount < 10000 || css->input_count < 10000 || !css->estimating) {
+        return false;
+    }
+
+    abbr_card = estimateHyperLogLog(&css->abbr_card);
+
+    /* plenty of distinct keys; stop paying for the estimate */
+    if (abbr_card > 100000.0) {
+        css->estimating = false;
+        return false;
+    }
+
+    if (abbr_card < css->input_count / 10000.0 + 0.5) {
+        return true;
+    }
+    return false;
+}
+
+Datum idn_canonical_sortsupport(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_canonical_sortsupport);
+Datum idn_canonical_sortsupport(PG_FUNCTION_ARGS)
+{
+    SortSupport ssup = (SortSupport) PG_GETARG_POINTER(0);
+    CanonicalSortSupport *css;
+    MemoryContext oldcontext;
+
+    oldcontext = MemoryContextSwitchTo(ssup->ssup_cxt);
+
+    css = palloc(sizeof(CanonicalSortSupport));
+    initStringInfo(&css->buf1);
+    initStringInfo(&css->buf2);
+    initStringInfo(&css->last1);
+    initStringInfo(&css->last2);
+    css->last1_valid = false;
+    css->last2_valid = false;
+    css->input_count = 0;
+    css->estimating = true;
+    ssup->ssup_extra = css;
+
+    if (ssup->abbreviate) {
+        initHyperLogLog(&css->abbr_card, 10);
+        ssup->comparator = canonical_abbrev_cmp;
+        ssup->abbrev_converter = canonical_abbrev_convert;
+        ssup->abbrev_abort = canonical_abbrev_abort;
+        ssup->abbrev_full_comparator = canonical_fastcmp;
+    } else {
+        ssup->comparator = canonical_fastcmp;
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Hashing on the canonical form.
+ *
+ * The hash covers the same bytes that idn_canonical_key orders by (the
+ * case-folded A-label form, without a trailing root dot), so names which
+ * are #=# equal always hash alike. The bytes are folded and mixed as they
+ * are read, so pure ASCII input is hashed without building a copy.
+ * The mixing steps are those of MurmurHash3 (x64); the result does not
+ * depend on the platform's byte order.
+ */
+
+#define CANONICAL_HASH_C1 UINT64CONST(0x87c37b91114253d5)
+#define CANONICAL_HASH_C2 UINT64CONST(0x4cf5ad432745937f)
+
+static inline uint64
+canonical_hash_rotl(uint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64
+canonical_hash_block(uint64 k)
+{
+    k *= CANONICAL_HASH_C1;
+    k = canonical_hash_rotl(k, 31);
+    k *= CANONICAL_HASH_C2;
+    return k;
+}
+
+static inline uint64
+canonical_hash_fmix(uint64 h)
+{
+    h ^= h >> 33;
+    h *= UINT64CONST(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64CONST(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+/* hash 'len' bytes of 'src', case-folding ASCII letters on the way */
+static uint64
+canonical_hash_bytes(const char *src, size_t len, uint64 seed)
+{
+    const unsigned char *p = (const unsigned char *) src;
+    uint64 h = seed;
+    uint64 k = 0;
+    size_t i;
+    int shift = 0;
+
+    for (i = 0; i < len; ++i) {
+        k |= ((uint64) pg_ascii_tolower(p[i])) << shift;
+        shift += 8;
+        if (shift == 64) {
+            h ^= canonical_hash_block(k);
+            h = canonical_hash_rotl(h, 27) * 5 + 0x52dce729;
+            k = 0;
+            shift = 0;
+        }
+    }
+    if (shift) {
+        h ^= canonical_hash_block(k);
+    }
+
+    h ^= (uint64) len;
+    return canonical_hash_fmix(h);
+}
+
+static uint64
+canonical_hash(text *arg, uint64 seed)
+{
+    char *utf8_src;
+    size_t utf8_srclen;
+    bool needs_free, malloced;
+    const char *name;
+    size_t namelen;
+    uint64 h;
+    int rc;
+
+    utf8_src = text_to_utf8(arg, &utf8_srclen, &needs_free, false);
+
+    /* as with the canonical ordering, names that cannot be converted are
+     * hashed as their case-folded input
+     */
+    name = canonical_alabel(utf8_src, utf8_srclen, &namelen, &malloced, &rc);
+
+    h = canonical_hash_bytes(name, namelen, seed);
+
+    if (malloced) {
+        free((void *) name);
+    }
+    if (needs_free) {
+        pfree(utf8_src);
+    }
+    return h;
+}
+
+/* hash support function 1 for idn_canonical_ops: the low 32 bits of
+ * the seeded hash with a seed of 0
+ */
+Datum idn_hash(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_hash);
+Datum idn_hash(PG_FUNCTION_ARGS)
+{
+    uint64 h = canonical_hash(PG_GETARG_TEXT_PP(0), 0);
+
+    PG_RETURN_INT32((int32) (uint32) h);
+}
+
+/* hash support function 2 for idn_canonical_ops, used by hash partitioning */
+Datum idn_hash_extended(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_hash_extended);
+Datum idn_hash_extended(PG_FUNCTION_ARGS)
+{
+    uint64 h = canonical_hash(PG_GETARG_TEXT_PP(0), (uint64) PG_GETARG_INT64(1));
+
+    PG_RETURN_INT64((int64) h);
+}
+
+/*
+ * Quiet conversions for the batch interfaces.
+ *
+ * Each operation is named after the SQL function it mirrors. Unlike
+ * the SQL functions, failures are reported through the return code
+ * only, so that a batch with a handful of bad names does not produce
+ * a WARNING per row. Inputs are NUL-terminated UTF-8; on success *dest
+ * is a NUL-terminated UTF-8 string which must be released with free().
+ */
+typedef int (*convert_fn)(const char *src, char **dest, int flags);
+
+struct idn_operation {
+    const char *name;
+    enum constant_scope scope; /* where flag names are looked up */
+    convert_fn convert;
+    const char *(*strerror)(int rc);
+};
+
+static int
+op_idn2_lookup(const char *src, char **dest, int flags)
+{
+    return idn2_lookup_u8((const uint8_t *) src, (uint8_t **) dest, idna2008_flags(flags));
+}
+
+static int
+op_idn2_register(const char *src, char **dest, int flags)
+{
+    return idn2_register_u8((const uint8_t *) src, NULL, (uint8_t **) dest, flags);
+}
+
+static int
+op_uts46_lookup(const char *src, char **dest, int flags)
+{
+    return idn2_lookup_u8((const uint8_t *) src, (uint8_t **) dest, uts46_flags(flags));
+}
+
+/* defined with idn2_to_unicode, below */
+static int op_idn2_to_unicode(const char *src, char **dest, int flags);
+
+static const char *
+op_idn2_strerror(int rc)
+{
+    return idn2_strerror(rc);
+}
+
+static int
+op_idna_encode(const char *src, char **dest, int flags)
+{
+    return idna_to_ascii_8z(src, dest, flags);
+}
+
+static int
+op_idna_decode(const char *src, char **dest, int flags)
+{
+    return idna_to_unicode_8z8z(src, dest, flags);
+}
+
+static const char *
+op_idna_strerror(int rc)
+{
+    return idna_strerror((Idna_rc) rc);
+}
+
+static int
+op_nfkc_normalize(const char *src, char **dest, int flags)
+{
+    /* flags ignored */
+    *dest = stringprep_utf8_nfkc_normalize(src, -1);
+    return (*dest == NULL) ? -1 : 0;
+}
+
+static const char *
+op_nfkc_strerror(int rc)
+{
+    return "Unknown error applying NFKC normalization.";
+}
+
+static const struct idn_operation _operations[] = {
+    {
+        .name = "idn2_lookup",
+        .scope = SCOPE_IDNA2,
+        .convert = op_idn2_lookup,
+        .strerror = op_idn2_strerror,
+    },
+    {
+        .name = "idn2_register",
+        .scope = SCOPE_IDNA2,
+        .convert = op_idn2_register,
+        .strerror = op_idn2_strerror,
+    },
+    {
+        .name = "idn2_to_unicode",
+        .scope = SCOPE_IDNA2,
+        .convert = op_idn2_to_unicode,
+        .strerror = op_idn2_strerror,
+    },
+    {
+        .name = "idn_uts46_lookup",
+        .scope = SCOPE_UTS46,
+        .convert = op_uts46_lookup,
+        .strerror = op_idn2_strerror,
+    },
+    {
+        .name = "idn_idna_encode",
+        .scope = SCOPE_IDNA,
+        .convert = op_idna_encode,
+        .strerror = op_idna_strerror,
+    },
+    {
+        .name = "idn_idna_decode",
+        .scope = SCOPE_IDNA,
+        .convert = op_idna_decode,
+        .strerror = op_idna_strerror,
+    },
+    {
+        .name = "idn_utf8_nfkc_normalize",
+        .scope = SCOPE_STRINGPREP,
+        .convert = op_nfkc_normalize,
+        .strerror = op_nfkc_strerror,
+    },
+};
+
+static const struct idn_operation *
+find_operation(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(_operations) / sizeof(struct idn_operation); ++i) {
+        if (pg_strcasecmp(_operations[i].name, name) == 0) {
+            return &_operations[i];
+        }
+    }
+    elog(ERROR, "Unknown operation name: %s", name);
+    return NULL; /* keep compiler quiet */
+}
+
+/* convert a UTF-8 string with the given operation, returning the result
+ * as text in the database encoding, or NULL on failure (with *rc set)
+ */
+static text *
+run_operation(const struct idn_operation *op, int flags, const char *utf8_src, int *rc)
+{
+    char *res;
+    text *ret;
+
+    *rc = op->convert(utf8_src, &res, flags);
+    if (*rc != 0 || res == NULL) {
+        return NULL;
+    }
+
+    ret = utf8_to_text(res, strlen(res));
+    free(res);
+    return ret;
+}
+
+/*
+ * Statement-level maintenance of derived columns.
+ *
+ * idn_sync_columns is created twice on the same table with the same
+ * arguments: as an AFTER ... FOR EACH ROW trigger, which records where
+ * each new or changed row is, and as an AFTER ... FOR EACH STATEMENT
+ * trigger, which converts and writes them all at once:
+ *
+ *   CREATE TRIGGER zone_idn_row AFTER INSERT OR UPDATE OF name ON zone
+ *       FOR EACH ROW EXECUTE PROCEDURE
+ *       idn_sync_columns('name', 'name_ascii', 'idn2_lookup',
+ *                        'name_unicode', 'idn_idna_decode:IDNA_FLAG_NONE');
+ *   CREATE TRIGGER zone_idn AFTER INSERT OR UPDATE OF name ON zone
+ *       FOR EACH STATEMENT EXECUTE PROCEDURE
+ *       idn_sync_columns('name', 'name_ascii', 'idn2_lookup',
+ *                        'name_unicode', 'idn_idna_decode:IDNA_FLAG_NONE');
+ *
+ * The first argument is the source column; the rest are pairs of target
+ * column and operation, where the operation may carry flags after a colon.
+ * Each distinct source value is converted once per target, and the targets
+ * are then written with a single UPDATE which finds the rows by ctid.
+ * Names which fail to convert, and NULL sources, get a NULL target.
+ *
+ * Transition tables would carry the new values, but not the ctid of the
+ * rows, which is why the row-level trigger is needed at all.
+ */
+
+struct sync_target {
+    char *column;
+    const struct idn_operation *op;
+    int flags;
+};
+
+/* one entry per distinct source value */
+struct sync_entry {
+    text *key; /* must be first */
+    int index;
+};
+
+/* rows recorded by the row-level trigger, waiting for the statement-level
+ * one; there is one batch per relation, trigger arguments and
+ * subtransaction, kept in TopTransactionContext
+ */
+struct sync_batch {
+    Oid relid;
+    int nargs;
+    char **args;
+    int source_attnum;
+    SubTransactionId subid;
+    int nrows;
+    int maxrows;
+    ItemPointerData *tids;
+    text **sources; /* NULL for a NULL source */
+};
+
+static List *sync_batches = NIL;
+static bool sync_callbacks_registered = false;
+
+/* relations whose targets are being written right now, so that the
+ * trigger ignores the UPDATE it runs itself; kept in TopMemoryContext
+ */
+static List *sync_relations = NIL;
+
+static uint32
+sync_entry_hash(const void *key, Size keysize)
+{
+    text *t = *((text * const *) key);
+
+    return DatumGetUInt32(hash_any((const unsigned char *) VARDATA_ANY(t),
+                                   VARSIZE_ANY_EXHDR(t)));
+}
+
+static int
+sync_entry_match(const void *key1, const void *key2, Size keysize)
+{
+    text *t1 = *((text * const *) key1);
+    text *t2 = *((text * const *) key2);
+    size_t len1 = VARSIZE_ANY_EXHDR(t1);
+
+    if (len1 != VARSIZE_ANY_EXHDR(t2)) {
+        return 1;
+    }
+    return memcmp(VARDATA_ANY(t1), VARDATA_ANY(t2), len1);
+}
+
+static void
+sync_xact_callback(XactEvent event, void *arg)
+{
+    switch (event) {
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_PARALLEL_COMMIT:
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+        case XACT_EVENT_PREPARE:
+            /* the batches go away with TopTransactionContext */
+            sync_batches = NIL;
+            break;
+        default:
+            break;
+    }
+}
+
+static void
+sync_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                      SubTransactionId parentSubid, void *arg)
+{
+    ListCell *lc, *prev, *next;
+
+    prev = NULL;
+    for (lc = list_head(sync_batches); lc != NULL; lc = next) {
+        struct sync_batch *batch = (struct sync_batch *) lfirst(lc);
+
+        next = lnext(lc);
+        if (batch->subid == mySubid) {
+            if (event == SUBXACT_EVENT_ABORT_SUB) {
+                /* the rows were never there */
+                sync_batches = list_delete_cell(sync_batches, lc, prev);
+                continue;
+            }
+            if (event == SUBXACT_EVENT_COMMIT_SUB) {
+                batch->subid = parentSubid;
+            }
+        }
+        prev = lc;
+    }
+}
+
+static bool
+sync_same_args(const Trigger *t1, const Trigger *t2)
+{
+    int i;
+
+    if (t1->tgnargs != t2->tgnargs) {
+        return false;
+    }
+    for (i = 0; i < t1->tgnargs; ++i) {
+        if (strcmp(t1->tgargs[i], t2->tgargs[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* is there an AFTER trigger of the other level, with our function and
+ * arguments, for this event?
+ */
+static bool
+sync_has_partner(Relation rel, const Trigger *trigger, TriggerEvent event, bool for_row)
+{
+    TriggerDesc *trigdesc = rel->trigdesc;
+    int i;
+
+    for (i = 0; trigdesc && i < trigdesc->numtriggers; ++i) {
+        const Trigger *t = &trigdesc->triggers[i];
+
+        if (t->tgfoid != trigger->tgfoid || !TRIGGER_FOR_AFTER(t->tgtype) ||
+            (TRIGGER_FOR_ROW(t->tgtype) != 0) != for_row) {
+            continue;
+        }
+        if (TRIGGER_FIRED_BY_INSERT(event) ? !TRIGGER_FOR_INSERT(t->tgtype)
+                                           : !TRIGGER_FOR_UPDATE(t->tgtype)) {
+            continue;
+        }
+        if (sync_same_args(t, trigger)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the batch for this relation and trigger in the current subtransaction */
+static struct sync_batch *
+sync_get_batch(Relation rel, const Trigger *trigger, TriggerEvent event)
+{
+    SubTransactionId subid = GetCurrentSubTransactionId();
+    MemoryContext oldcontext;
+    struct sync_batch *batch;
+    ListCell *lc;
+    int source_attnum, i;
+
+    foreach(lc, sync_batches) {
+        batch = (struct sync_batch *) lfirst(lc);
+        if (batch->relid == RelationGetRelid(rel) && batch->subid == subid &&
+            batch->nargs == trigger->tgnargs) {
+            for (i = 0; i < batch->nargs; ++i) {
+                if (strcmp(batch->args[i], trigger->tgargs[i]) != 0) {
+                    break;
+                }
+            }
+            if (i == batch->nargs) {
+                return batch;
+            }
+        }
+    }
+
+    /* without it, the rows would be recorded and never written */
+    if (!sync_has_partner(rel, trigger, event, false)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("idn_sync_columns: trigger \"%s\" has no matching FOR EACH STATEMENT trigger",
+                        trigger->tgname),
+                 errhint("Create idn_sync_columns as an AFTER ... FOR EACH STATEMENT trigger "
+                         "on the same table, with the same arguments.")));
+    }
+
+    source_attnum = SPI_fnumber(RelationGetDescr(rel), trigger->tgargs[0]);
+    if (source_attnum <= 0) {
+        elog(ERROR, "idn_sync_columns: column \"%s\" does not exist", trigger->tgargs[0]);
+    }
+
+    if (!sync_callbacks_registered) {
+        RegisterXactCallback(sync_xact_callback, NULL);
+        RegisterSubXactCallback(sync_subxact_callback, NULL);
+        sync_callbacks_registered = true;
+    }
+
+    oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+    batch = palloc(sizeof(struct sync_batch));
+    batch->relid = RelationGetRelid(rel);
+    batch->nargs = trigger->tgnargs;
+    batch->args = palloc(sizeof(char *) * batch->nargs);
+    for (i = 0; i < batch->nargs; ++i) {
+        batch->args[i] = pstrdup(trigger->tgargs[i]);
+    }
+    batch->source_attnum = source_attnum;
+    batch->subid = subid;
+    batch->nrows = 0;
+    batch->maxrows = 64;
+    batch->tids = palloc(sizeof(ItemPointerData) * batch->maxrows);
+    batch->sources = palloc(sizeof(text *) * batch->maxrows);
+    sync_batches = lappend(sync_batches, batch);
+    MemoryContextSwitchTo(oldcontext);
+
+    return batch;
+}
+
+/* give back what a long transaction would otherwise pile up */
+static void
+sync_free_batches(List *batches)
+{
+    ListCell *lc;
+    int i;
+
+    foreach(lc, batches) {
+        struct sync_batch *batch = (struct sync_batch *) lfirst(lc);
+
+        for (i = 0; i < batch->nrows; ++i) {
+            if (batch->sources[i]) {
+                pfree(batch->sources[i]);
+            }
+        }
+        for (i = 0; i < batch->nargs; ++i) {
+            pfree(batch->args[i]);
+        }
+        pfree(batch->args);
+        pfree(batch->tids);
+        pfree(batch->sources);
+        pfree(batch);
+    }
+    list_free(batches);
+}
+
+/* row level: remember where the row is and what its source is */
+static void
+sync_record_row(TriggerData *trigdata)
+{
+    Relation rel = trigdata->tg_relation;
+    TupleDesc tupdesc = RelationGetDescr(rel);
+    struct sync_batch *batch;
+    HeapTuple tuple;
+    MemoryContext oldcontext;
+    Datum d;
+    bool isnull;
+
+    batch = sync_get_batch(rel, trigdata->tg_trigger, trigdata->tg_event);
+
+    if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event)) {
+        Datum old;
+        bool old_isnull;
+
+        tuple = trigdata->tg_newtuple;
+        d = heap_getattr(tuple, batch->source_attnum, tupdesc, &isnull);
+        old = heap_getattr(trigdata->tg_trigtuple, batch->source_attnum, tupdesc, &old_isnull);
+        if (isnull == old_isnull && (isnull || datumIsEqual(d, old, false, -1))) {
+            /* the targets are still good */
+            return;
+        }
+    } else {
+        tuple = trigdata->tg_trigtuple;
+        d = heap_getattr(tuple, batch->source_attnum, tupdesc, &isnull);
+    }
+
+    oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+    if (batch->nrows == batch->maxrows) {
+        batch->maxrows *= 2;
+        batch->tids = repalloc(batch->tids, sizeof(ItemPointerData) * batch->maxrows);
+        batch->sources = repalloc(batch->sources, sizeof(text *) * batch->maxrows);
+    }
+    ItemPointerCopy(&tuple->t_self, &batch->tids[batch->nrows]);
+    batch->sources[batch->nrows] = isnull ? NULL : (text *) PG_DETOAST_DATUM_COPY(d);
+    batch->nrows++;
+    MemoryContextSwitchTo(oldcontext);
+}
+
+Datum idn_sync_columns(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_sync_columns);
+Datum idn_sync_columns(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *) fcinfo->context;
+    Trigger *trigger;
+    Relation rel;
+    Oid relid;
+    TupleDesc tupdesc;
+    struct sync_target *targets;
+    int ntargets, nrows, row, i, j, rc;
+    HTAB *seen;
+    HASHCTL ctl;
+    Datum *tids, *sources;
+    bool *source_nulls;
+    Datum **results;
+    bool **result_nulls;
+    Oid *argtypes;
+    Datum *args;
+    int dims[1], lbs[1];
+    ListCell *lc, *prev, *next;
+    List *batches;
+    MemoryContext oldcontext;
+    StringInfoData sql;
+
+    if (!CALLED_AS_TRIGGER(fcinfo)) {
+        elog(ERROR, "idn_sync_columns: not called by trigger manager");
+    }
+    if (!TRIGGER_FIRED_AFTER(trigdata->tg_event)) {
+        elog(ERROR, "idn_sync_columns: must be fired AFTER");
+    }
+    if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) &&
+        !TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event)) {
+        elog(ERROR, "idn_sync_columns: must be fired for INSERT or UPDATE");
+    }
+
+    trigger = trigdata->tg_trigger;
+    rel = trigdata->tg_relation;
+    relid = RelationGetRelid(rel);
+    tupdesc = RelationGetDescr(rel);
+
+    if (list_member_oid(sync_relations, relid)) {
+        /* our own UPDATE, below */
+        return PointerGetDatum(NULL);
+    }
+
+    if (trigger->tgnargs < 3 || (trigger->tgnargs % 2) != 1) {
+        elog(ERROR, "idn_sync_columns: expected a source column followed by (target column, operation) pairs");
+    }
+
+    if (TRIGGER_FIRED_FOR_ROW(trigdata->tg_event)) {
+        sync_record_row(trigdata);
+        return PointerGetDatum(NULL);
+    }
+
+    if (!sync_has_partner(rel, trigger, trigdata->tg_event, true)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("idn_sync_columns: trigger \"%s\" has no matching FOR EACH ROW trigger",
+                        trigger->tgname),
+                 errhint("Create idn_sync_columns as an AFTER ... FOR EACH ROW trigger "
+                         "on the same table, with the same arguments.")));
+    }
+
+    /* take every batch for this relation and trigger; a nested statement
+     * on the same table may already have written some of them
+     */
+    batches = NIL;
+    nrows = 0;
+    prev = NULL;
+    for (lc = list_head(sync_batches); lc != NULL; lc = next) {
+        struct sync_batch *batch = (struct sync_batch *) lfirst(lc);
+
+        next = lnext(lc);
+        if (batch->relid == relid && batch->nargs == trigger->tgnargs) {
+            for (i = 0; i < batch->nargs; ++i) {
+                if (strcmp(batch->args[i], trigger->tgargs[i]) != 0) {
+                    break;
+                }
+            }
+            if (i == batch->nargs) {
+                batches = lappend(batches, batch);
+                nrows += batch->nrows;
+                sync_batches = list_delete_cell(sync_batches, lc, prev);
+                continue;
+            }
+        }
+        prev = lc;
+    }
+
+    if (nrows == 0) {
+        sync_free_batches(batches);
+        return PointerGetDatum(NULL);
+    }
+
+    /* parse the targets once for the whole statement */
+    ntargets = (trigger->tgnargs - 1) / 2;
+    targets = palloc(sizeof(struct sync_target) * ntargets);
+    for (i = 0; i < ntargets; ++i) {
+        char *opname = pstrdup(trigger->tgargs[2 + 2 * i]);
+        char *flagstr = strchr(opname, ':');
+
+        targets[i].column = trigger->tgargs[1 + 2 * i];
+        if (SPI_fnumber(tupdesc, targets[i].column) <= 0) {
+            elog(ERROR, "idn_sync_columns: column \"%s\" does not exist", targets[i].column);
+        }
+        if (flagstr) {
+            *flagstr++ = '\0';
+        }
+        targets[i].op = find_operation(opname);
+        targets[i].flags = flagstr ? parse_constant_multi(targets[i].op->scope, flagstr) : 0;
+
+        /* as with the SQL functions, only the libidn routines need this */
+        if (targets[i].op->scope != SCOPE_IDNA2) {
+            check_stringprep();
+        }
+    }
+
+    /* convert each distinct source value once */
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(text *);
+    ctl.entrysize = sizeof(struct sync_entry);
+    ctl.hash = sync_entry_hash;
+    ctl.match = sync_entry_match;
+    ctl.hcxt = CurrentMemoryContext;
+    seen = hash_create("idn_sync_columns values", 1024, &ctl,
+                       HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+
+    tids = palloc(sizeof(Datum) * nrows);
+    sources = palloc(sizeof(Datum) * nrows);
+    source_nulls = palloc(sizeof(bool) * nrows);
+    results = palloc(sizeof(Datum *) * ntargets);
+    result_nulls = palloc(sizeof(bool *) * ntargets);
+    for (i = 0; i < ntargets; ++i) {
+        results[i] = palloc(sizeof(Datum) * nrows);
+        result_nulls[i] = palloc(sizeof(bool) * nrows);
+    }
+
+    row = 0;
+    foreach(lc, batches) {
+        struct sync_batch *batch = (struct sync_batch *) lfirst(lc);
+        int k;
+
+        for (k = 0; k < batch->nrows; ++k, ++row) {
+            struct sync_entry *entry;
+            text *value = batch->sources[k];
+            bool found;
+            char *utf8_src;
+            size_t utf8_srclen;
+            bool needs_free;
+
+            tids[row] = PointerGetDatum(&batch->tids[k]);
+            sources[row] = PointerGetDatum(value);
+            source_nulls[row] = (value == NULL);
+            if (value == NULL) {
+                for (i = 0; i < ntargets; ++i) {
+                    result_nulls[i][row] = true;
+                }
+                continue;
+            }
+
+            entry = hash_search(seen, &value, HASH_ENTER, &found);
+            if (found) {
+                for (i = 0; i < ntargets; ++i) {
+                    results[i][row] = results[i][entry->index];
+                    result_nulls[i][row] = result_nulls[i][entry->index];
+                }
+                continue;
+            }
+            entry->index = row;
+
+            utf8_src = text_to_utf8(value, &utf8_srclen, &needs_free, true);
+            for (i = 0; i < ntargets; ++i) {
+                text *res = run_operation(targets[i].op, targets[i].flags, utf8_src, &rc);
+
+                results[i][row] = PointerGetDatum(res);
+                result_nulls[i][row] = (res == NULL);
+            }
+            if (needs_free) {
+                pfree(utf8_src);
+            }
+        }
+    }
+    hash_destroy(seen);
+
+    /* UPDATE ONLY rel AS t SET tgt1 = v.c1, ...
+     *   FROM unnest($1, $2, $3, ...) AS v(tid, src, c1, ...)
+     *   WHERE t.ctid = ANY($1) AND t.ctid = v.tid
+     *     AND t.src IS NOT DISTINCT FROM v.src
+     *     AND (t.tgt1 IS DISTINCT FROM v.c1 OR ...)
+     *
+     * ctid = ANY() gets a TID scan, so no index is needed; the source
+     * check skips rows which were updated again since they were recorded.
+     */
+    initStringInfo(&sql);
+    appendStringInfo(&sql, "UPDATE ONLY %s AS t SET ",
+                     quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)),
+                                                RelationGetRelationName(rel)));
+    for (i = 0; i < ntargets; ++i) {
+        appendStringInfo(&sql, "%s%s = v.c%d", i ? ", " : "",
+                         quote_identifier(targets[i].column), i + 1);
+    }
+    appendStringInfoString(&sql, " FROM unnest($1, $2");
+    for (i = 0; i < ntargets; ++i) {
+        appendStringInfo(&sql, ", $%d", i + 3);
+    }
+    appendStringInfoString(&sql, ") AS v(tid, src");
+    for (i = 0; i < ntargets; ++i) {
+        appendStringInfo(&sql, ", c%d", i + 1);
+    }
+    appendStringInfo(&sql, ") WHERE t.ctid = ANY($1) AND t.ctid = v.tid"
+                     " AND t.%s IS NOT DISTINCT FROM v.src AND (",
+                     quote_identifier(trigger->tgargs[0]));
+    for (i = 0; i < ntargets; ++i) {
+        appendStringInfo(&sql, "%st.%s IS DISTINCT FROM v.c%d", i ? " OR " : "",
+                         quote_identifier(targets[i].column), i + 1);
+    }
+    appendStringInfoChar(&sql, ')');
+
+    dims[0] = nrows;
+    lbs[0] = 1;
+    argtypes = palloc(sizeof(Oid) * (ntargets + 2));
+    args = palloc(sizeof(Datum) * (ntargets + 2));
+    argtypes[0] = get_array_type(TIDOID);
+    args[0] = PointerGetDatum(construct_array(tids, nrows, TIDOID,
+                                              sizeof(ItemPointerData), false, 's'));
+    argtypes[1] = TEXTARRAYOID;
+    args[1] = PointerGetDatum(construct_md_array(sources, source_nulls, 1, dims, lbs,
+                                                 TEXTOID, -1, false, 'i'));
+    for (j = 0; j < ntargets; ++j) {
+        argtypes[j + 2] = TEXTARRAYOID;
+        args[j + 2] = PointerGetDatum(construct_md_array(results[j], result_nulls[j], 1, dims, lbs,
+                                                         TEXTOID, -1, false, 'i'));
+    }
+
+    if ((rc = SPI_connect()) != SPI_OK_CONNECT) {
+        elog(ERROR, "idn_sync_columns: SPI_connect returned %d", rc);
+    }
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    sync_relations = lcons_oid(relid, sync_relations);
+    MemoryContextSwitchTo(oldcontext);
+    PG_TRY();
+    {
+        rc = SPI_execute_with_args(sql.data, ntargets + 2, argtypes, args, NULL, false, 0);
+        if (rc != SPI_OK_UPDATE) {
+            elog(ERROR, "idn_sync_columns: SPI_execute_with_args returned %d", rc);
+        }
+    }
+    PG_CATCH();
+    {
+        sync_relations = list_delete_first(sync_relations);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    sync_relations = list_delete_first(sync_relations);
+
+    SPI_finish();
+    sync_free_batches(batches);
+
+    return PointerGetDatum(NULL);
+}
+
+/*
+ * Cheap structural classification.
+ *
+ * idn_classify looks at the raw bytes of its argument, in the database
+ * encoding, and never calls into libidn or libidn2. Lengths are byte
+ * counts of the input; for names with U-labels the A-label form may be
+ * longer, so IDN_CLASS_INVALID is only conclusive for ASCII names.
+ */
+
+/* per-byte classes */
+#define CLASSIFY_LDH   0x01
+#define CLASSIFY_DOT   0x02
+#define CLASSIFY_ASCII 0x04 /* ASCII, but neither LDH nor a dot */
+#define CLASSIFY_HIGH  0x08
+
+static uint8 classify_bytes[256];
+
+static void
+classify_init(void)
+{
+    int c;
+
+    for (c = 0; c < 256; ++c) {
+        if (c >= 0x80) {
+            classify_bytes[c] = CLASSIFY_HIGH;
+        } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                   (c >= '0' && c <= '9') || c == '-') {
+            classify_bytes[c] = CLASSIFY_LDH;
+        } else if (c == '.') {
+            classify_bytes[c] = CLASSIFY_DOT;
+        } else {
+            classify_bytes[c] = CLASSIFY_ASCII;
+        }
+    }
+}
+
+static bool
+classify_is_alabel(const unsigned char *label, size_t len)
+{
+    return len >= 4 &&
+           (label[0] | 0x20) == 'x' &&
+           (label[1] | 0x20) == 'n' &&
+           label[2] == '-' &&
+           label[3] == '-';
+}
+
+static int
+classify_name(const unsigned char *src, size_t len)
+{
+    uint8 seen = 0;
+    int res = 0;
+    size_t i, label_start = 0;
+
+    if (len == 0) {
+        return IDN_CLASS_INVALID;
+    }
+
+    for (i = 0; i < len; ++i) {
+        uint8 c = classify_bytes[src[i]];
+
+        seen |= c;
+        if (c == CLASSIFY_DOT) {
+            if (i == label_start || i - label_start > 63) {
+                res |= IDN_CLASS_INVALID;
+            }
+            if (classify_is_alabel(src + label_start, i - label_start)) {
+                res |= IDN_CLASS_ALABEL;
+            }
+            label_start = i + 1;
+        }
+    }
+
+    /* the last label; it may only be empty as the trailing root dot */
+    if (label_start == len) {
+        len--;
+    } else {
+        if (len - label_start > 63) {
+            res |= IDN_CLASS_INVALID;
+        }
+        if (classify_is_alabel(src + label_start, len - label_start)) {
+            res |= IDN_CLASS_ALABEL;
+        }
+    }
+    if (len > 253) {
+        res |= IDN_CLASS_INVALID;
+    }
+
+    if (seen & CLASSIFY_HIGH) {
+        res |= IDN_CLASS_ULABEL;
+    }
+    if (seen & CLASSIFY_ASCII) {
+        res |= IDN_CLASS_NON_LDH;
+    }
+    if (!(seen & (CLASSIFY_HIGH | CLASSIFY_ASCII))) {
+        res |= IDN_CLASS_LDH;
+    }
+    return res;
+}
+
+Datum idn_classify(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_classify);
+Datum idn_classify(PG_FUNCTION_ARGS)
+{
+    text *arg0;
+
+    if (PG_NARGS() != 1) {
+        elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+    /* while the function is defined as strict, this belts-and-suspenders
+     * doesn't hurt
+     */
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+    arg0 = PG_GETARG_TEXT_PP(0);
+
+    PG_RETURN_INT32(classify_name((const unsigned char *) VARDATA_ANY(arg0),
+                                  VARSIZE_ANY_EXHDR(arg0)));
+}
+
+/*
+ * Streaming conversion of a server-side file.
+ *
+ * idn_convert_file reads a newline-delimited UTF-8 file in chunks and
+ * returns one row per line: (line_no, input, output, rc). Each line is
+ * NUL-terminated in place in the read buffer, since libidn wants that,
+ * and failures are reported in rc rather than as WARNINGs. Lines which
+ * are not valid UTF-8 come back with a NULL input and output and
+ * rc = IDN2_ENCODING_ERROR.
+ *
+ * The file is read with read() rather than mapped: a mapping of a file
+ * truncated by someone else while the scan runs would take the backend
+ * (and so the cluster) down with SIGBUS, where read() just sees the end
+ * of the file early. The descriptor is a transient file, so fd.c closes
+ * it if the query fails; otherwise it is closed when the scan ends, or
+ * when the executor shuts the function down early (under a LIMIT, say).
+ */
+
+#define CONVERT_FILE_CHUNK (64 * 1024)
+
+struct convert_file_state {
+    int fd;
+    char *path;
+    char *buf; /* buf[start .. end) is read but not yet returned */
+    size_t buflen;
+    size_t start;
+    size_t end;
+    bool eof;
+    int64 line_no;
+    const struct idn_operation *op;
+    int flags;
+};
+
+static void
+convert_file_close(struct convert_file_state *state)
+{
+    if (state->fd >= 0) {
+        CloseTransientFile(state->fd);
+        state->fd = -1;
+    }
+}
+
+/* runs at executor shutdown, but not on error */
+static void
+convert_file_shutdown(Datum arg)
+{
+    convert_file_close((struct convert_file_state *) DatumGetPointer(arg));
+}
+
+/* the next line, NUL-terminated in the buffer without its line ending, or
+ * NULL at the end of the file
+ */
+static char *
+convert_file_next_line(struct convert_file_state *state, size_t *linelen)
+{
+    char *line, *eol;
+    size_t scanned = 0;
+
+    for (;;) {
+        ssize_t nread;
+
+        eol = memchr(state->buf + state->start + scanned, '\n',
+                     state->end - state->start - scanned);
+        if (eol != NULL || state->eof) {
+            break;
+        }
+        scanned = state->end - state->start;
+
+        /* make room: move the partial line to the front, and grow the
+         * buffer if the line fills it (one byte is kept for the NUL)
+         */
+        if (state->start > 0) {
+            memmove(state->buf, state->buf + state->start, scanned);
+            state->start = 0;
+            state->end = scanned;
+        }
+        if (state->end + 1 >= state->buflen) {
+            state->buflen *= 2;
+            state->buf = repalloc(state->buf, state->buflen);
+        }
+
+        nread = read(state->fd, state->buf + state->end, state->buflen - state->end - 1);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not read file \"%s\": %m", state->path)));
+        }
+        if (nread == 0) {
+            state->eof = true;
+        }
+        state->end += nread;
+    }
+
+    line = state->buf + state->start;
+    if (eol == NULL) {
+        /* last line, without a trailing newline */
+        if (state->start == state->end) {
+            return NULL;
+        }
+        eol = state->buf + state->end;
+        state->start = state->end;
+    } else {
+        state->start = eol - state->buf + 1;
+    }
+    *linelen = eol - line;
+    if (*linelen > 0 && line[*linelen - 1] == '\r') {
+        (*linelen)--;
+    }
+    line[*linelen] = '\0';
+    return line;
+}
+
+Datum idn_convert_file(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_convert_file);
+Datum idn_convert_file(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    struct convert_file_state *state;
+    char *line;
+    size_t linelen;
+
+    if (SRF_IS_FIRSTCALL()) {
+        ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        char *opname;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+
+        if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) {
+            SRF_RETURN_DONE(funcctx);
+        }
+
+        if (!superuser() && !is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_SERVER_FILES)) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                     errmsg("must be superuser or a member of the pg_read_server_files role to use idn_convert_file")));
+        }
+
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            elog(ERROR, "return type must be a row type");
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        state = palloc0(sizeof(struct convert_file_state));
+        state->fd = -1;
+        opname = text_to_cstring(PG_GETARG_TEXT_PP(1));
+        state->op = find_operation(opname);
+        pfree(opname);
+        if (PG_NARGS() > 2 && !PG_ARGISNULL(2)) {
+            state->flags = parse_text_arg_flags(PG_GETARG_TEXT_PP(2), state->op->scope);
+        }
+        if (state->op->scope != SCOPE_IDNA2) {
+            check_stringprep();
+        }
+
+        state->path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+        state->fd = OpenTransientFile(state->path, O_RDONLY | PG_BINARY);
+        if (state->fd < 0) {
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not open file \"%s\" for reading: %m", state->path)));
+        }
+        if (rsinfo != NULL && IsA(rsinfo, ReturnSetInfo)) {
+            RegisterExprContextCallback(rsinfo->econtext, convert_file_shutdown,
+                                        PointerGetDatum(state));
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        (void) posix_fadvise(state->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        state->buflen = CONVERT_FILE_CHUNK;
+        state->buf = palloc(state->buflen);
+
+        funcctx->user_fctx = state;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (struct convert_file_state *) funcctx->user_fctx;
+
+    if (state != NULL && (line = convert_file_next_line(state, &linelen)) != NULL) {
+        Datum values[4];
+        bool nulls[4] = {false, false, false, false};
+        HeapTuple tuple;
+        int rc;
+
+        state->line_no++;
+        values[0] = Int64GetDatum(state->line_no);
+
+        if (!pg_verify_mbstr(PG_UTF8, line, linelen, true)) {
+            nulls[1] = nulls[2] = true;
+            values[3] = Int32GetDatum(IDN2_ENCODING_ERROR);
+        } else {
+            text *res = run_operation(state->op, state->flags, line, &rc);
+
+            values[1] = PointerGetDatum(utf8_to_text(line, linelen));
+            if (res == NULL) {
+                nulls[2] = true;
+            } else {
+                values[2] = PointerGetDatum(res);
+            }
+            values[3] = Int32GetDatum(rc);
+        }
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    if (state != NULL) {
+        convert_file_close(state);
+    }
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * UTS#46 (Unicode IDNA Compatibility Processing).
+ *
+ * The mapping, case folding, normalization and validation are done in a
+ * single pass by libidn2, using the tables it compiles from the Unicode
+ * IdnaMappingTable.txt. This is what browsers do with user-typed names,
+ * so u&'\00d6BB.at' is looked up as xn--bb-eka.at.
+ */
+Datum idn_uts46_lookup(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_uts46_lookup);
+Datum idn_uts46_lookup(PG_FUNCTION_ARGS)
+{
+    text *arg0;
+    text *result;
+    int flags = 0;
+    char *utf8_src;
+    size_t utf8_srclen;
+    bool needs_free;
+    char *lookupname;
+    int rc;
+
+    switch (PG_NARGS()) {
+        case 2:
+            if (!PG_ARGISNULL(1)) {
+                flags = parse_text_arg_flags(PG_GETARG_TEXT_PP(1), SCOPE_UTS46);
+            }
+        case 1:
+            if (PG_ARGISNULL(0)) {
+                PG_RETURN_NULL();
+            }
+            arg0 = PG_GETARG_TEXT_PP(0);
+            break;
+        default:
+            elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+
+    utf8_src = text_to_utf8(arg0, &utf8_srclen, &needs_free, true);
+
+    rc = op_uts46_lookup(utf8_src, &lookupname, flags);
+
+    if (needs_free) {
+        pfree(utf8_src);
+    }
+
+    if (rc != IDN2_OK) {
+        ereport(WARNING,
+                (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+                 errmsg_internal("Error encountered performing UTS#46 lookup: %s",
+                                 idn2_strerror(rc))));
+        PG_RETURN_NULL();
+    }
+
+    result = utf8_to_text(lookupname, strlen(lookupname));
+    free(lookupname);
+
+    PG_RETURN_TEXT_P(result);
+}
+
+/*
+ * IDNA2008 to-Unicode conversion.
+ *
+ * Labels without the ACE prefix are copied through untouched; A-labels
+ * are Punycode-decoded straight into the output buffer and then validated
+ * by converting the U-label back with idn2_lookup_u8, which must give the
+ * original A-label (RFC 5891, section 5.5). A mostly-ASCII name therefore
+ * costs little more than a copy.
+ *
+ * An A-label of n bytes decodes to at most n - 4 code points of at most
+ * 4 bytes each, so an output buffer of 4 * srclen + 1 bytes is always
+ * enough, including room for the temporary NUL terminator needed for the
+ * round trip check.
+ */
+#define TO_UNICODE_BUFSIZE(srclen) (4 * (srclen) + 1)
+
+static size_t
+ucs4_to_utf8(punycode_uint cp, char *dest)
+{
+    unsigned char *d = (unsigned char *) dest;
+
+    if (cp < 0x80) {
+        d[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        d[0] = 0xC0 | (cp >> 6);
+        d[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if (cp < 0x10000) {
+        d[0] = 0xE0 | (cp >> 12);
+        d[1] = 0x80 | ((cp >> 6) & 0x3F);
+        d[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    d[0] = 0xF0 | (cp >> 18);
+    d[1] = 0x80 | ((cp >> 12) & 0x3F);
+    d[2] = 0x80 | ((cp >> 6) & 0x3F);
+    d[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+/* decode one A-label (including its prefix) into dest, returning an
+ * idn2 rc. 'ucs4' must have room for labellen code points.
+ */
+static int
+to_unicode_label(const char *label, size_t labellen, char *dest, size_t *destlen,
+                 punycode_uint *ucs4, int flags)
+{
+    size_t ucs4_len = labellen;
+    size_t i, len = 0;
+    uint8_t *roundtrip;
+    int rc;
+
+    /* a bare "xn--" is not an A-label of anything */
+    if (labellen == 4 ||
+        punycode_decode(labellen - 4, label + 4, &ucs4_len, ucs4, NULL) != PUNYCODE_SUCCESS) {
+        return IDN2_PUNYCODE_BAD_INPUT;
+    }
+
+    for (i = 0; i < ucs4_len; ++i) {
+        /* A-labels are case-insensitive; their basic code points are not */
+        if (ucs4[i] >= 'A' && ucs4[i] <= 'Z') {
+            ucs4[i] += 'a' - 'A';
+        }
+        if (ucs4[i] == 0 || ucs4[i] > 0x10FFFF ||
+            (ucs4[i] >= 0xD800 && ucs4[i] <= 0xDFFF)) {
+            return IDN2_ENCODING_ERROR;
+        }
+        len += ucs4_to_utf8(ucs4[i], dest + len);
+    }
+    dest[len] = '\0';
+
+    rc = idn2_lookup_u8((uint8_t *) dest, &roundtrip, flags);
+    if (rc != IDN2_OK) {
+        return rc;
+    }
+    if (strlen((char *) roundtrip) != labellen ||
+        pg_strncasecmp((char *) roundtrip, label, labellen) != 0) {
+        rc = IDN2_ALABEL_ROUNDTRIP_FAILED;
+    }
+    free(roundtrip);
+
+    *destlen = len;
+    return rc;
+}
+
+/* convert srclen bytes of UTF-8 at src into dest, which must hold
+ * TO_UNICODE_BUFSIZE(srclen) bytes. Returns an idn2 rc.
+ */
+static int
+to_unicode_name(const char *src, size_t srclen, char *dest, size_t *destlen,
+                punycode_uint *ucs4, int flags)
+{
+    const char *label = src;
+    const char *end = src + srclen;
+    size_t len = 0;
+    int rc;
+
+    flags = idna2008_flags(flags);
+
+    while (label <= end) {
+        const char *label_end = memchr(label, '.', end - label);
+        size_t labellen;
+
+        if (label_end == NULL) {
+            label_end = end;
+        }
+        labellen = label_end - label;
+
+        if (classify_is_alabel((const unsigned char *) label, labellen)) {
+            size_t ulabel_len;
+
+            rc = to_unicode_label(label, labellen, dest + len, &ulabel_len, ucs4, flags);
+            if (rc != IDN2_OK) {
+                return rc;
+            }
+            len += ulabel_len;
+        } else {
+            memcpy(dest + len, label, labellen);
+            len += labellen;
+        }
+
+        if (label_end == end) {
+            break;
+        }
+        dest[len++] = '.';
+        label = label_end + 1;
+    }
+
+    *destlen = len;
+    return IDN2_OK;
+}
+
+static bool
+has_alabel(const char *src, size_t srclen)
+{
+    const char *label = src;
+    const char *end = src + srclen;
+
+    for (;;) {
+        const char *label_end = memchr(label, '.', end - label);
+
+        if (label_end == NULL) {
+            label_end = end;
+        }
+        if (classify_is_alabel((const unsigned char *) label, label_end - label)) {
+            return true;
+        }
+        if (label_end == end) {
+            return false;
+        }
+        label = label_end + 1;
+    }
+}
+
+static int
+op_idn2_to_unicode(const char *src, char **dest, int flags)
+{
+    size_t srclen = strlen(src);
+    size_t destlen;
+    punycode_uint *ucs4;
+    int rc;
+
+    *dest = malloc(TO_UNICODE_BUFSIZE(srclen));
+    if (*dest == NULL) {
+        return IDN2_MALLOC;
+    }
+    ucs4 = palloc(sizeof(punycode_uint) * (srclen + 1));
+
+    rc = to_unicode_name(src, srclen, *dest, &destlen, ucs4, flags);
+    pfree(ucs4);
+
+    if (rc != IDN2_OK) {
+        free(*dest);
+        *dest = NULL;
+        return rc;
+    }
+    (*dest)[destlen] = '\0';
+    return IDN2_OK;
+}
+
+Datum libidn2_to_unicode(PG_FUNCTION_ARGS);
+/*
+Perform IDNA2008 to-Unicode conversion on domain name src, decoding only the A-labels.
+ */
+PG_FUNCTION_INFO_V1(libidn2_to_unicode);
+Datum libidn2_to_unicode(PG_FUNCTION_ARGS)
+{
+    text *arg0;
+    text *result;
+    int flags = 0;
+    char *utf8_src, *dest;
+    size_t utf8_srclen, destlen;
+    bool needs_free, direct;
+    punycode_uint *ucs4;
+    int rc;
+
+    switch (PG_NARGS()) {
+        case 2:
+            if (!PG_ARGISNULL(1)) {
+                flags = parse_text_arg_flags(PG_GETARG_TEXT_PP(1), SCOPE_IDNA2);
+            }
+        case 1:
+            if (PG_ARGISNULL(0)) {
+                PG_RETURN_NULL();
+            }
+            arg0 = PG_GETARG_TEXT_PP(0);
+            break;
+        default:
+            elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+
+    /* punycode_decode comes from libidn */
+    if (!check_stringprep()) {
+        /* actually, check_stringprep raises ERROR */
+        PG_RETURN_NULL();
+    }
+
+    utf8_src = text_to_utf8(arg0, &utf8_srclen, &needs_free, false);
+
+    /* nothing to decode: hand back the argument itself */
+    if (!has_alabel(utf8_src, utf8_srclen)) {
+        if (needs_free) {
+            pfree(utf8_src);
+        }
+        PG_RETURN_TEXT_P(arg0);
+    }
+
+    /* in a UTF-8 database the result is written straight into the
+     * returned text; otherwise it has to be converted afterwards
+     */
+    direct = (GetDatabaseEncoding() == PG_UTF8);
+    if (direct) {
+        result = palloc(VARHDRSZ + TO_UNICODE_BUFSIZE(utf8_srclen));
+        dest = VARDATA(result);
+    } else {
+        result = NULL;
+        dest = palloc(TO_UNICODE_BUFSIZE(utf8_srclen));
+    }
+    ucs4 = palloc(sizeof(punycode_uint) * (utf8_srclen + 1));
+
+    rc = to_unicode_name(utf8_src, utf8_srclen, dest, &destlen, ucs4, flags);
+
+    pfree(ucs4);
+    if (needs_free) {
+        pfree(utf8_src);
+    }
+
+    if (rc != IDN2_OK) {
+        pfree(direct ? (void *) result : (void *) dest);
+        ereport(WARNING,
+                (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+                 errmsg_internal("Error encountered performing idn2 to-unicode conversion: %s",
+                                 idn2_strerror(rc))));
+        PG_RETURN_NULL();
+    }
+
+    if (direct) {
+        SET_VARSIZE(result, VARHDRSZ + destlen);
+    } else {
+        result = utf8_to_text(dest, destlen);
+        pfree(dest);
+    }
+    PG_RETURN_TEXT_P(result);
+}
+
+/*
+ * Validation summary aggregate.
+ *
+ * idn_validation_summary(name [, checks]) runs the IDN_CHECK_* checks
+ * named in checks (all of them when omitted or NULL) over every non-NULL
+ * name in one pass, and returns a jsonb object with the number of names
+ * seen and, per check, the number of failures broken down by return code:
+ *
+ *   {"rows": 4, "idna2008_lookup": {"codes": {"-304": 1}, "failed": 1}}
+ *
+ * Failures are only counted, never reported as WARNINGs. The checks must
+ * be the same for every row of a group. The state is serializable and
+ * has a combine function, so the aggregate can run in parallel.
+ */
+
+static int
+check_pr29(const char *src)
+{
+    return pr29_8z(src);
+}
+
+static int
+check_idna2003(const char *src)
+{
+    char *res;
+    int rc = op_idna_encode(src, &res, 0);
+
+    if (rc == IDNA_SUCCESS) {
+        free(res);
+    }
+    return rc;
+}
+
+static int
+check_idna2008_lookup(const char *src)
+{
+    char *res;
+    int rc = op_idn2_lookup(src, &res, 0);
+
+    if (rc == IDN2_OK) {
+        free(res);
+    }
+    return rc;
+}
+
+/* idn2_register works on a single label, so check each one in turn; the
+ * empty label after the trailing dot of a fully qualified name is skipped
+ */
+static int
+check_idna2008_register(const char *src)
+{
+    char *copy = pstrdup(src);
+    char *label = copy;
+    char *res, *dot;
+    int rc;
+
+    do {
+        dot = strchr(label, '.');
+        if (dot) {
+            *dot = '\0';
+        }
+        rc = op_idn2_register(label, &res, 0);
+        if (rc != IDN2_OK) {
+            break;
+        }
+        free(res);
+        if (dot) {
+            label = dot + 1;
+            if (*label == '\0') {
+                break;
+            }
+        }
+    } while (dot);
+
+    pfree(copy);
+    return rc;
+}
+
+/* 1 if normalization changes the name, -1 if it fails */
+static int
+check_nfkc(const char *src)
+{
+    char *res;
+    int rc;
+
+    if (op_nfkc_normalize(src, &res, 0) != 0) {
+        return -1;
+    }
+    rc = (strcmp(res, src) == 0) ? 0 : 1;
+    free(res);
+    return rc;
+}
+
+struct validation_check {
+    int flag;
+    const char *name; /* key in the result */
+    int (*check)(const char *src);
+};
+
+static const struct validation_check _checks[] = {
+    { IDN_CHECK_PR29, "pr29", check_pr29 },
+    { IDN_CHECK_IDNA2003, "idna2003", check_idna2003 },
+    { IDN_CHECK_IDNA2008_LOOKUP, "idna2008_lookup", check_idna2008_lookup },
+    { IDN_CHECK_IDNA2008_REGISTER, "idna2008_register", check_idna2008_register },
+    { IDN_CHECK_NFKC, "nfkc", check_nfkc },
+};
+
+#define VALIDATION_NCHECKS ((int) (sizeof(_checks) / sizeof(struct validation_check)))
+#define VALIDATION_ALL_CHECKS (IDN_CHECK_PR29 | IDN_CHECK_IDNA2003 | \
+                               IDN_CHECK_IDNA2008_LOOKUP | \
+                               IDN_CHECK_IDNA2008_REGISTER | IDN_CHECK_NFKC)
+
+/* failure count for one return code of one check */
+struct validation_code {
+    int32 check; /* index into _checks */
+    int32 rc;
+    int64 count;
+};
+
+typedef struct {
+    int32 checks;
+    text *checks_arg; /* as given on the first row; NULL if omitted */
+    int64 rows;
+    int ncodes;
+    int maxcodes;
+    struct validation_code *codes;
+} ValidationState;
+
+static ValidationState *
+validation_state_new(MemoryContext context, int32 checks)
+{
+    ValidationState *state;
+
+    state = MemoryContextAllocZero(context, sizeof(ValidationState));
+    state->checks = checks;
+    state->maxcodes = 8;
+    state->codes = MemoryContextAlloc(context,
+                                      state->maxcodes * sizeof(struct validation_code));
+    return state;
+}
+
+/* there are only ever a handful of distinct codes, so a list will do */
+static void
+validation_count(ValidationState *state, int32 check, int32 rc, int64 count)
+{
+    int i;
+
+    for (i = 0; i < state->ncodes; ++i) {
+        if (state->codes[i].check == check && state->codes[i].rc == rc) {
+            state->codes[i].count += count;
+            return;
+        }
+    }
+    if (state->ncodes == state->maxcodes) {
+        state->maxcodes *= 2;
+        state->codes = repalloc(state->codes,
+                                state->maxcodes * sizeof(struct validation_code));
+    }
+    state->codes[state->ncodes].check = check;
+    state->codes[state->ncodes].rc = rc;
+    state->codes[state->ncodes].count = count;
+    state->ncodes++;
+}
+
+static bool
+validation_same_checks(text *a, text *b)
+{
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return VARSIZE_ANY_EXHDR(a) == VARSIZE_ANY_EXHDR(b) &&
+           memcmp(VARDATA_ANY(a), VARDATA_ANY(b), VARSIZE_ANY_EXHDR(a)) == 0;
+}
+
+Datum idn_validation_accum(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_validation_accum);
+Datum idn_validation_accum(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    ValidationState *state;
+    text *checks_arg = NULL;
+    char *utf8_src;
+    size_t utf8_srclen;
+    bool needs_free;
+    int i, rc;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        elog(ERROR, "idn_validation_accum called in non-aggregate context");
+    }
+
+    switch (PG_NARGS()) {
+        case 3:
+            if (!PG_ARGISNULL(2)) {
+                checks_arg = PG_GETARG_TEXT_PP(2);
+            }
+        case 2:
+            break;
+        default:
+            elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+
+    if (PG_ARGISNULL(0)) {
+        int32 checks = VALIDATION_ALL_CHECKS;
+
+        if (checks_arg) {
+            checks = parse_text_arg_flags(checks_arg, SCOPE_VALIDATE);
+        }
+        state = validation_state_new(aggcontext, checks);
+        if (checks_arg) {
+            state->checks_arg = MemoryContextAlloc(aggcontext, VARSIZE_ANY(checks_arg));
+            memcpy(state->checks_arg, checks_arg, VARSIZE_ANY(checks_arg));
+        }
+    } else {
+        state = (ValidationState *) PG_GETARG_POINTER(0);
+        /* parsing the checks once per row would cost more than comparing */
+        if (!validation_same_checks(state->checks_arg, checks_arg)) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("idn_validation_summary checks must be the same for every row")));
+        }
+    }
+
+    if (PG_ARGISNULL(1)) {
+        PG_RETURN_POINTER(state);
+    }
+
+    /* the library functions require a NUL-terminated input */
+    utf8_src = text_to_utf8(PG_GETARG_TEXT_PP(1), &utf8_srclen, &needs_free, true);
+
+    state->rows++;
+    for (i = 0; i < VALIDATION_NCHECKS; ++i) {
+        if (!(state->checks & _checks[i].flag)) {
+            continue;
+        }
+        rc = _checks[i].check(utf8_src);
+        if (rc != 0) {
+            validation_count(state, i, rc, 1);
+        }
+    }
+
+    if (needs_free) {
+        pfree(utf8_src);
+    }
+
+    PG_RETURN_POINTER(state);
+}
+
+Datum idn_validation_combine(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_validation_combine);
+Datum idn_validation_combine(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext;
+    ValidationState *state1, *state2;
+    int i;
+
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        elog(ERROR, "idn_validation_combine called in non-aggregate context");
+    }
+
+    state1 = PG_ARGISNULL(0) ? NULL : (ValidationState *) PG_GETARG_POINTER(0);
+    state2 = PG_ARGISNULL(1) ? NULL : (ValidationState *) PG_GETARG_POINTER(1);
+
+    if (state2 == NULL) {
+        if (state1 == NULL) {
+            PG_RETURN_NULL();
+        }
+        PG_RETURN_POINTER(state1);
+    }
+
+    /* state2 may live in a shorter-lived context, so always copy from it */
+    if (state1 == NULL) {
+        state1 = validation_state_new(aggcontext, state2->checks);
+    } else if (state1->checks != state2->checks) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("idn_validation_summary checks must be the same for every row")));
+    }
+
+    state1->rows += state2->rows;
+    for (i = 0; i < state2->ncodes; ++i) {
+        validation_count(state1, state2->codes[i].check, state2->codes[i].rc,
+                         state2->codes[i].count);
+    }
+
+    PG_RETURN_POINTER(state1);
+}
+
+Datum idn_validation_serialize(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_validation_serialize);
+Datum idn_validation_serialize(PG_FUNCTION_ARGS)
+{
+    ValidationState *state;
+    StringInfoData buf;
+    int i;
+
+    if (!AggCheckCallContext(fcinfo, NULL)) {
+        elog(ERROR, "idn_validation_serialize called in non-aggregate context");
+    }
+    state = (ValidationState *) PG_GETARG_POINTER(0);
+
+    pq_begintypsend(&buf);
+    pq_sendint32(&buf, state->checks);
+    pq_sendint64(&buf, state->rows);
+    pq_sendint32(&buf, state->ncodes);
+    for (i = 0; i < state->ncodes; ++i) {
+        pq_sendint32(&buf, state->codes[i].check);
+        pq_sendint32(&buf, state->codes[i].rc);
+        pq_sendint64(&buf, state->codes[i].count);
+    }
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum idn_validation_deserialize(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_validation_deserialize);
+Datum idn_validation_deserialize(PG_FUNCTION_ARGS)
+{
+    ValidationState *state;
+    bytea *sstate;
+    StringInfoData buf;
+    int32 check, rc;
+    int64 count;
+    int i, ncodes;
+
+    if (!AggCheckCallContext(fcinfo, NULL)) {
+        elog(ERROR, "idn_validation_deserialize called in non-aggregate context");
+    }
+    sstate = PG_GETARG_BYTEA_PP(0);
+
+    initStringInfo(&buf);
+    appendBinaryStringInfo(&buf, VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+
+    state = validation_state_new(CurrentMemoryContext, (int32) pq_getmsgint(&buf, 4));
+    state->rows = pq_getmsgint64(&buf);
+    ncodes = (int) pq_getmsgint(&buf, 4);
+    for (i = 0; i < ncodes; ++i) {
+        check = (int32) pq_getmsgint(&buf, 4);
+        rc = (int32) pq_getmsgint(&buf, 4);
+        count = pq_getmsgint64(&buf);
+        if (check < 0 || check >= VALIDATION_NCHECKS) {
+            elog(ERROR, "invalid check in idn_validation_summary state: %d", check);
+        }
+        validation_count(state, check, rc, count);
+    }
+    pq_getmsgend(&buf);
+    pfree(buf.data);
+
+    PG_RETURN_POINTER(state);
+}
+
+Datum idn_validation_final(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_validation_final);
+Datum idn_validation_final(PG_FUNCTION_ARGS)
+{
+    ValidationState *state;
+    StringInfoData buf;
+    int64 failed;
+    bool first;
+    int i, j;
+
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_NULL();
+    }
+    state = (ValidationState *) PG_GETARG_POINTER(0);
+
+    initStringInfo(&buf);
+    appendStringInfo(&buf, "{\"rows\": " INT64_FORMAT, state->rows);
+    for (i = 0; i < VALIDATION_NCHECKS; ++i) {
+        if (!(state->checks & _checks[i].flag)) {
+            continue;
+        }
+        failed = 0;
+        for (j = 0; j < state->ncodes; ++j) {
+            if (state->codes[j].check == i) {
+                failed += state->codes[j].count;
+            }
+        }
+        appendStringInfo(&buf, ", \"%s\": {\"failed\": " INT64_FORMAT ", \"codes\": {",
+                         _checks[i].name, failed);
+        first = true;
+        for (j = 0; j < state->ncodes; ++j) {
+            if (state->codes[j].check == i) {
+                appendStringInfo(&buf, "%s\"%d\": " INT64_FORMAT,
+                                 first ? "" : ", ",
+                                 state->codes[j].rc, state->codes[j].count);
+                first = false;
+            }
+        }
+        appendStringInfoString(&buf, "}}");
+    }
+    appendStringInfoChar(&buf, '}');
+
+    PG_RETURN_DATUM(DirectFunctionCall1(jsonb_in, CStringGetDatum(buf.data)));
+}
+
+/*
+ * Approximate distinct counts of canonical names.
+ *
+ * A sketch is a HyperLogLog with 2^IDN_HLL_PRECISION one-byte registers,
+ * fed with the 64-bit canonical hash (idn_hash(name, 0)), so names that
+ * are equal under #=# count once. It is stored as a plain bytea: a
+ * version byte, the precision, then the registers. Sketches of the same
+ * precision merge by taking the register-wise maximum, so per-day sketches
+ * can be kept in a table and rolled up with idn_hll_merge. A NULL sketch
+ * is treated as empty.
+ *
+ * Inside an aggregate the transition value is updated in place; called
+ * directly, idn_hll_add and idn_hll_union return a new sketch.
+ */
+
+#define IDN_HLL_VERSION     1
+#define IDN_HLL_PRECISION   12
+#define IDN_HLL_REGISTERS   (1 << IDN_HLL_PRECISION)
+#define IDN_HLL_HEADERSZ    2
+#define IDN_HLL_SIZE        (VARHDRSZ + IDN_HLL_HEADERSZ + IDN_HLL_REGISTERS)
+
+#define IDN_HLL_REGS(sketch) ((uint8 *) VARDATA(sketch) + IDN_HLL_HEADERSZ)
+
+static bytea *
+idn_hll_new(MemoryContext context)
+{
+    bytea *sketch = MemoryContextAllocZero(context, IDN_HLL_SIZE);
+
+    SET_VARSIZE(sketch, IDN_HLL_SIZE);
+    ((uint8 *) VARDATA(sketch))[0] = IDN_HLL_VERSION;
+    ((uint8 *) VARDATA(sketch))[1] = IDN_HLL_PRECISION;
+    return sketch;
+}
+
+static void
+idn_hll_check(bytea *sketch)
+{
+    if (VARSIZE(sketch) != IDN_HLL_SIZE ||
+        ((uint8 *) VARDATA(sketch))[0] != IDN_HLL_VERSION ||
+        ((uint8 *) VARDATA(sketch))[1] != IDN_HLL_PRECISION) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid idn_hll sketch")));
+    }
+}
+
+/* fetch a sketch argument, copying it unless we may scribble on it */
+static bytea *
+idn_hll_getarg(FunctionCallInfo fcinfo, int argno, MemoryContext aggcontext)
+{
+    bytea *sketch;
+
+    if (aggcontext && argno == 0) {
+        /* our own transition value, allocated below in aggcontext */
+        sketch = PG_GETARG_BYTEA_P(0);
+    } else {
+        sketch = PG_GETARG_BYTEA_P_COPY(argno);
+    }
+    idn_hll_check(sketch);
+    return sketch;
+}
+
+static void
+idn_hll_insert(bytea *sketch, uint64 h)
+{
+    uint8 *regs = IDN_HLL_REGS(sketch);
+    uint32 idx = (uint32) (h >> (64 - IDN_HLL_PRECISION));
+    uint64 w = h << IDN_HLL_PRECISION;
+    uint8 rank = 1;
+
+    /* position of the first set bit in the remaining hash bits */
+    while (rank <= 64 - IDN_HLL_PRECISION && !(w & UINT64CONST(0x8000000000000000))) {
+        rank++;
+        w <<= 1;
+    }
+    if (regs[idx] < rank) {
+        regs[idx] = rank;
+    }
+}
+
+Datum idn_hll_add(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_hll_add);
+Datum idn_hll_add(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext = NULL;
+    bytea *sketch;
+
+    if (PG_NARGS() != 2) {
+        elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        aggcontext = NULL;
+    }
+
+    if (PG_ARGISNULL(0)) {
+        sketch = idn_hll_new(aggcontext ? aggcontext : CurrentMemoryContext);
+    } else {
+        sketch = idn_hll_getarg(fcinfo, 0, aggcontext);
+    }
+
+    if (!PG_ARGISNULL(1)) {
+        idn_hll_insert(sketch, canonical_hash(PG_GETARG_TEXT_PP(1), 0));
+    }
+
+    PG_RETURN_BYTEA_P(sketch);
+}
+
+Datum idn_hll_union(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_hll_union);
+Datum idn_hll_union(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcontext = NULL;
+    bytea *sketch, *other;
+    uint8 *regs, *oregs;
+    int i;
+
+    if (PG_NARGS() != 2) {
+        elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+    if (!AggCheckCallContext(fcinfo, &aggcontext)) {
+        aggcontext = NULL;
+    }
+
+    if (PG_ARGISNULL(1)) {
+        if (PG_ARGISNULL(0)) {
+            PG_RETURN_NULL();
+        }
+        PG_RETURN_BYTEA_P(idn_hll_getarg(fcinfo, 0, aggcontext));
+    }
+
+    other = PG_GETARG_BYTEA_PP(1);
+    if (PG_ARGISNULL(0)) {
+        /* the other sketch may live in a shorter-lived context */
+        sketch = idn_hll_new(aggcontext ? aggcontext : CurrentMemoryContext);
+    } else {
+        sketch = idn_hll_getarg(fcinfo, 0, aggcontext);
+    }
+
+    if (VARSIZE_ANY_EXHDR(other) != IDN_HLL_HEADERSZ + IDN_HLL_REGISTERS ||
+        memcmp(VARDATA_ANY(other), VARDATA(sketch), IDN_HLL_HEADERSZ) != 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid idn_hll sketch")));
+    }
+
+    regs = IDN_HLL_REGS(sketch);
+    oregs = (uint8 *) VARDATA_ANY(other) + IDN_HLL_HEADERSZ;
+    for (i = 0; i < IDN_HLL_REGISTERS; ++i) {
+        if (regs[i] < oregs[i]) {
+            regs[i] = oregs[i];
+        }
+    }
+
+    PG_RETURN_BYTEA_P(sketch);
+}
+
+Datum idn_hll_cardinality(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_hll_cardinality);
+Datum idn_hll_cardinality(PG_FUNCTION_ARGS)
+{
+    bytea *sketch;
+    uint8 *regs;
+    double m = IDN_HLL_REGISTERS;
+    double sum = 0.0;
+    double estimate;
+    int zeros = 0;
+    int i;
+
+    if (PG_ARGISNULL(0)) {
+        PG_RETURN_INT64(0);
+    }
+    sketch = PG_GETARG_BYTEA_P(0);
+    idn_hll_check(sketch);
+    regs = IDN_HLL_REGS(sketch);
+
+    for (i = 0; i < IDN_HLL_REGISTERS; ++i) {
+        sum += ldexp(1.0, -regs[i]);
+        if (regs[i] == 0) {
+            zeros++;
+        }
+    }
+
+    estimate = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+    /* small cardinalities: linear counting is far more accurate. With
+     * 64-bit hashes there is no need for a large-range correction.
+     */
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * log(m / zeros);
+    }
+
+    PG_RETURN_INT64((int64) (estimate + 0.5));
+}
+
+/*
+ * Online backfill of a converted column.
+ *
+ * idn_backfill_start records a job in idn_backfill_jobs and, once the
+ * calling transaction commits, starts a dynamic background worker for
+ * it. The worker walks the table in ranges of batch_pages blocks. For
+ * each range it scans the heap directly (heap_setscanlimits), converts
+ * the source column with the quiet operations, and writes only the rows
+ * whose target differs, with an UPDATE on their ctids. Every range is
+ * its own transaction, which also saves the job's position, and the
+ * worker sleeps batch_delay_ms between ranges.
+ *
+ * The table is walked up to the size it had when the job started;
+ * later inserts (and rows updated concurrently with a batch) are
+ * expected to be kept in sync by idn_sync_columns or the application.
+ * A failed, cancelled or interrupted job carries on from where it
+ * stopped through idn_backfill_resume.
+ */
+
+struct backfill_launch {
+    Oid dboid;
+    Oid roleoid;
+};
+
+struct backfill_pending {
+    int32 job_id;
+    SubTransactionId subid; /* where the job was queued */
+    struct backfill_launch launch;
+};
+
+/* workers to start when the current transaction commits */
+static List *backfill_pending = NIL;
+static bool backfill_callback_registered = false;
+
+PGDLLEXPORT void idn_backfill_main(Datum main_arg);
+
+/* the job table lives in the extension's schema, wherever that is now;
+ * must be called with SPI connected
+ */
+static char *
+backfill_jobs_table(void)
+{
+    int rc;
+
+    rc = SPI_execute("SELECT n.nspname FROM pg_catalog.pg_extension e "
+                     "JOIN pg_catalog.pg_namespace n ON n.oid = e.extnamespace "
+                     "WHERE e.extname = 'idn'", true, 1);
+    if (rc != SPI_OK_SELECT || SPI_processed != 1) {
+        elog(ERROR, "idn backfill: could not find the schema of extension \"idn\"");
+    }
+    return psprintf("%s",
+                    quote_qualified_identifier(SPI_getvalue(SPI_tuptable->vals[0],
+                                                            SPI_tuptable->tupdesc, 1),
+                                               "idn_backfill_jobs"));
+}
+
+static AttrNumber
+backfill_column(Oid relid, const char *column)
+{
+    AttrNumber attnum = get_attnum(relid, column);
+    Oid type;
+
+    if (attnum <= 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_COLUMN),
+                 errmsg("column \"%s\" of relation \"%s\" does not exist",
+                        column, get_rel_name(relid))));
+    }
+    type = get_atttype(relid, attnum);
+    if (type != TEXTOID && type != VARCHAROID) {
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("column \"%s\" of relation \"%s\" must be of type text or varchar",
+                        column, get_rel_name(relid))));
+    }
+    return attnum;
+}
+
+static void
+backfill_check_relation(Oid relid, const char *source, const char *target,
+                        AttrNumber *source_attnum, AttrNumber *target_attnum)
+{
+    char relkind = get_rel_relkind(relid);
+    AclResult aclresult;
+
+    if (relkind == '\0') {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                 errmsg("relation with OID %u does not exist", relid)));
+    }
+    if (relkind != RELKIND_RELATION) {
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a table", get_rel_name(relid)),
+                 errhint("For a partitioned table, start a job for each partition.")));
+    }
+
+    /* the worker reads the heap directly, so check for SELECT ourselves */
+    aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+    if (aclresult == ACLCHECK_OK) {
+        aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_UPDATE);
+    }
+    if (aclresult != ACLCHECK_OK) {
+        aclcheck_error(aclresult, OBJECT_TABLE, get_rel_name(relid));
+    }
+
+    *source_attnum = backfill_column(relid, source);
+    *target_attnum = backfill_column(relid, target);
+}
+
+static void
+backfill_start_worker(struct backfill_pending *job)
+{
+    BackgroundWorker worker;
+    BackgroundWorkerHandle *handle;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "idn");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "idn_backfill_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "idn backfill job %d", job->job_id);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "idn backfill");
+    worker.bgw_main_arg = Int32GetDatum(job->job_id);
+    memcpy(worker.bgw_extra, &job->launch, sizeof(struct backfill_launch));
+
+    /* we are past the commit: complain, but never raise an error */
+    if (!RegisterDynamicBackgroundWorker(&worker, &handle)) {
+        ereport(WARNING,
+                (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                 errmsg("could not start a background worker for idn backfill job %d",
+                        job->job_id),
+                 errhint("Raise max_worker_processes, then call idn_backfill_resume(%d).",
+                         job->job_id)));
+    }
+}
+
+static void
+backfill_xact_callback(XactEvent event, void *arg)
+{
+    ListCell *lc;
+
+    if (backfill_pending == NIL) {
+        return;
+    }
+    switch (event) {
+        case XACT_EVENT_COMMIT:
+            foreach(lc, backfill_pending) {
+                backfill_start_worker((struct backfill_pending *) lfirst(lc));
+            }
+            break;
+        case XACT_EVENT_ABORT:
+            /* the job's INSERT (or resume's UPDATE) is rolled back with
+             * us, so a new job is discarded and a resumed one is left as
+             * it was
+             */
+            break;
+        case XACT_EVENT_PREPARE:
+            /* the job stays pending; once the prepared transaction
+             * commits, idn_backfill_resume starts it
+             */
+            break;
+        default:
+            return;
+    }
+    list_free_deep(backfill_pending);
+    backfill_pending = NIL;
+}
+
+/* a job queued in a subtransaction which rolls back is gone with it */
+static void
+backfill_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                          SubTransactionId parentSubid, void *arg)
+{
+    ListCell *lc, *prev, *next;
+
+    prev = NULL;
+    for (lc = list_head(backfill_pending); lc != NULL; lc = next) {
+        struct backfill_pending *job = (struct backfill_pending *) lfirst(lc);
+
+        next = lnext(lc);
+        if (job->subid == mySubid) {
+            if (event == SUBXACT_EVENT_ABORT_SUB) {
+                backfill_pending = list_delete_cell(backfill_pending, lc, prev);
+                pfree(job);
+                continue;
+            }
+            if (event == SUBXACT_EVENT_COMMIT_SUB) {
+                job->subid = parentSubid;
+            }
+        }
+        prev = lc;
+    }
+}
+
+static void
+backfill_queue(int32 job_id, Oid roleoid)
+{
+    MemoryContext oldcontext;
+    struct backfill_pending *job;
+
+    if (!backfill_callback_registered) {
+        RegisterXactCallback(backfill_xact_callback, NULL);
+        RegisterSubXactCallback(backfill_subxact_callback, NULL);
+        backfill_callback_registered = true;
+    }
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    job = palloc(sizeof(struct backfill_pending));
+    job->job_id = job_id;
+    job->subid = GetCurrentSubTransactionId();
+    job->launch.dboid = MyDatabaseId;
+    job->launch.roleoid = roleoid;
+    backfill_pending = lappend(backfill_pending, job);
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/* fetch the job row, locked, for the functions below; returns false if
+ * there is no such job
+ */
+static bool
+backfill_fetch_job(const char *jobs, const char *columns, int32 job_id)
+{
+    Oid argtypes[1] = { INT4OID };
+    Datum args[1];
+    int rc;
+
+    args[0] = Int32GetDatum(job_id);
+    rc = SPI_execute_with_args(psprintf("SELECT %s FROM %s WHERE job_id = $1 FOR UPDATE",
+                                        columns, jobs),
+                               1, argtypes, args, NULL, false, 1);
+    if (rc != SPI_OK_SELECT) {
+        elog(ERROR, "idn backfill: SPI_execute_with_args returned %d", rc);
+    }
+    return SPI_processed == 1;
+}
+
+static Datum
+backfill_job_value(int column, bool *isnull)
+{
+    return SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, column, isnull);
+}
+
+/* for resume and cancel: only the job's owner may touch it */
+static void
+backfill_check_owner(int32 job_id, Oid owner)
+{
+    if (!has_privs_of_role(GetUserId(), owner)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("must be a member of role \"%s\" to change idn backfill job %d",
+                        GetUserNameFromId(owner, false), job_id)));
+    }
+}
+
+Datum idn_backfill_start(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_backfill_start);
+Datum idn_backfill_start(PG_FUNCTION_ARGS)
+{
+    Oid relid;
+    char *source, *target, *opname;
+    const struct idn_operation *op;
+    int32 batch_pages, batch_delay, job_id;
+    AttrNumber source_attnum, target_attnum;
+    Oid argtypes[8] = { REGCLASSOID, NAMEOID, NAMEOID, TEXTOID, TEXTOID, INT4OID, INT4OID, REGROLEOID };
+    Datum args[8];
+    char nulls[8];
+    bool isnull;
+    int i, rc;
+
+    if (PG_NARGS() != 7) {
+        elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+    for (i = 0; i < 7; ++i) {
+        /* only the flags may be NULL */
+        if (i != 4 && PG_ARGISNULL(i)) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                     errmsg("only the flags of idn_backfill_start may be NULL")));
+        }
+    }
+
+    relid = PG_GETARG_OID(0);
+    source = NameStr(*PG_GETARG_NAME(1));
+    target = NameStr(*PG_GETARG_NAME(2));
+    opname = text_to_cstring(PG_GETARG_TEXT_PP(3));
+    op = find_operation(opname);
+    if (!PG_ARGISNULL(4)) {
+        /* parse now, so that a bad flag fails here and not in the worker */
+        (void) parse_text_arg_flags(PG_GETARG_TEXT_PP(4), op->scope);
+    }
+    if (op->scope != SCOPE_IDNA2) {
+        check_stringprep();
+    }
+    batch_pages = PG_GETARG_INT32(5);
+    batch_delay = PG_GETARG_INT32(6);
+    if (batch_pages < 1 || batch_delay < 0) {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("batch_pages must be positive and batch_delay_ms must not be negative")));
+    }
+
+    backfill_check_relation(relid, source, target, &source_attnum, &target_attnum);
+
+    memset(nulls, ' ', sizeof(nulls));
+    for (i = 0; i < 7; ++i) {
+        args[i] = PG_GETARG_DATUM(i);
+        if (PG_ARGISNULL(i)) {
+            nulls[i] = 'n';
+        }
+    }
+    /* the canonical spelling of the operation */
+    args[3] = CStringGetTextDatum(op->name);
+    args[7] = ObjectIdGetDatum(GetUserId());
+
+    if ((rc = SPI_connect()) != SPI_OK_CONNECT) {
+        elog(ERROR, "idn_backfill_start: SPI_connect returned %d", rc);
+    }
+    rc = SPI_execute_with_args(psprintf("INSERT INTO %s (relid, source_column, target_column, "
+                                        "operation, flags, batch_pages, batch_delay_ms, owner) "
+                                        "VALUES ($1, $2, $3, $4, $5, $6, $7, $8) RETURNING job_id",
+                                        backfill_jobs_table()),
+                               8, argtypes, args, nulls, false, 1);
+    if (rc != SPI_OK_INSERT_RETURNING || SPI_processed != 1) {
+        elog(ERROR, "idn_backfill_start: SPI_execute_with_args returned %d", rc);
+    }
+    job_id = DatumGetInt32(backfill_job_value(1, &isnull));
+    SPI_finish();
+
+    backfill_queue(job_id, GetUserId());
+
+    PG_RETURN_INT32(job_id);
+}
+
+Datum idn_backfill_resume(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_backfill_resume);
+Datum idn_backfill_resume(PG_FUNCTION_ARGS)
+{
+    int32 job_id = PG_GETARG_INT32(0);
+    char *jobs, *status;
+    Oid owner;
+    Datum pid;
+    bool pid_isnull, isnull;
+    Oid argtypes[1] = { INT4OID };
+    Datum args[1];
+    int rc;
+
+    if ((rc = SPI_connect()) != SPI_OK_CONNECT) {
+        elog(ERROR, "idn_backfill_resume: SPI_connect returned %d", rc);
+    }
+    jobs = backfill_jobs_table();
+    if (!backfill_fetch_job(jobs, "status, worker_pid, owner", job_id)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_OBJECT),
+                 errmsg("idn backfill job %d does not exist", job_id)));
+    }
+    status = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+    pid = backfill_job_value(2, &pid_isnull);
+    owner = DatumGetObjectId(backfill_job_value(3, &isnull));
+    backfill_check_owner(job_id, owner);
+
+    if (strcmp(status, "done") == 0 ||
+        (strcmp(status, "running") == 0 && !pid_isnull &&
+         BackendPidGetProc(DatumGetInt32(pid)) != NULL)) {
+        SPI_finish();
+        PG_RETURN_BOOL(false);
+    }
+
+    args[0] = Int32GetDatum(job_id);
+    rc = SPI_execute_with_args(psprintf("UPDATE %s SET status = 'pending', worker_pid = NULL, "
+                                        "error = NULL, finished_at = NULL WHERE job_id = $1",
+                                        jobs),
+                               1, argtypes, args, NULL, false, 0);
+    if (rc != SPI_OK_UPDATE) {
+        elog(ERROR, "idn_backfill_resume: SPI_execute_with_args returned %d", rc);
+    }
+    SPI_finish();
+
+    /* the worker runs as whoever started the job */
+    backfill_queue(job_id, owner);
+
+    PG_RETURN_BOOL(true);
+}
+
+Datum idn_backfill_cancel(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_backfill_cancel);
+Datum idn_backfill_cancel(PG_FUNCTION_ARGS)
+{
+    int32 job_id = PG_GETARG_INT32(0);
+    char *jobs, *status;
+    bool isnull;
+    Oid argtypes[1] = { INT4OID };
+    Datum args[1];
+    int rc;
+
+    if ((rc = SPI_connect()) != SPI_OK_CONNECT) {
+        elog(ERROR, "idn_backfill_cancel: SPI_connect returned %d", rc);
+    }
+    jobs = backfill_jobs_table();
+    if (!backfill_fetch_job(jobs, "status, owner", job_id)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_OBJECT),
+                 errmsg("idn backfill job %d does not exist", job_id)));
+    }
+    status = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+    backfill_check_owner(job_id, DatumGetObjectId(backfill_job_value(2, &isnull)));
+
+    if (strcmp(status, "pending") != 0 && strcmp(status, "running") != 0) {
+        SPI_finish();
+        PG_RETURN_BOOL(false);
+    }
+
+    /* a running worker notices before its next batch */
+    args[0] = Int32GetDatum(job_id);
+    rc = SPI_execute_with_args(psprintf("UPDATE %s SET status = 'cancelled', finished_at = now() "
+                                        "WHERE job_id = $1", jobs),
+                               1, argtypes, args, NULL, false, 0);
+    if (rc != SPI_OK_UPDATE) {
+        elog(ERROR, "idn_backfill_cancel: SPI_execute_with_args returned %d", rc);
+    }
+    SPI_finish();
+
+    PG_RETURN_BOOL(true);
+}
+
+/* true if the value and the current target differ */
+static bool
+backfill_differs(text *value, Datum current, bool current_isnull)
+{
+    text *cur;
+
+    if (value == NULL || current_isnull) {
+        return (value == NULL) != current_isnull;
+    }
+    cur = DatumGetTextPP(current);
+    return VARSIZE_ANY_EXHDR(value) != VARSIZE_ANY_EXHDR(cur) ||
+           memcmp(VARDATA_ANY(value), VARDATA_ANY(cur), VARSIZE_ANY_EXHDR(value)) != 0;
+}
+
+/*
+ * Run one batch of the job in the current transaction. Returns false
+ * once the job is finished, cancelled, or owned by another worker;
+ * otherwise sets *delay to the pause before the next batch.
+ */
+static bool
+backfill_batch(int32 job_id, int *delay)
+{
+    char *jobs, *source, *target, *status, *opname, *flagstr;
+    const struct idn_operation *op;
+    int flags = 0;
+    Oid relid;
+    int32 batch_pages;
+    int64 next_block, total_blocks;
+    BlockNumber nblocks, numblks;
+    AttrNumber source_attnum, target_attnum;
+    Relation rel;
+    TupleDesc tupdesc;
+    HeapScanDesc scan;
+    HeapTuple tuple;
+    Datum *tids, *sources, *values;
+    bool *source_nulls, *value_nulls;
+    int ntids, maxtids;
+    int64 updated = 0, failed = 0;
+    bool isnull, done;
+    int dims[1], lbs[1];
+    Oid argtypes[5];
+    Datum args[5];
+    int rc;
+
+    if ((rc = SPI_connect()) != SPI_OK_CONNECT) {
+        elog(ERROR, "idn backfill: SPI_connect returned %d", rc);
+    }
+    PushActiveSnapshot(GetTransactionSnapshot());
+
+    jobs = backfill_jobs_table();
+    if (!backfill_fetch_job(jobs, "relid, source_column, target_column, operation, flags, "
+                            "batch_pages, batch_delay_ms, status, worker_pid, next_block, "
+                            "total_blocks", job_id)) {
+        /* the job was deleted */
+        SPI_finish();
+        PopActiveSnapshot();
+        return false;
+    }
+    relid = DatumGetObjectId(backfill_job_value(1, &isnull));
+    source = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2);
+    target = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 3);
+    opname = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 4);
+    flagstr = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 5);
+    batch_pages = DatumGetInt32(backfill_job_value(6, &isnull));
+    *delay = DatumGetInt32(backfill_job_value(7, &isnull));
+    status = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 8);
+    if (strcmp(status, "running") == 0) {
+        Datum pid = backfill_job_value(9, &isnull);
+
+        if (isnull || DatumGetInt32(pid) != MyProcPid) {
+            status = NULL;
+        }
+    } else if (strcmp(status, "pending") != 0) {
+        status = NULL;
+    }
+    if (status == NULL) {
+        /* cancelled, finished, or some other worker's */
+        SPI_finish();
+        PopActiveSnapshot();
+        return false;
+    }
+    next_block = DatumGetInt64(backfill_job_value(10, &isnull));
+    total_blocks = DatumGetInt64(backfill_job_value(11, &isnull));
+    if (isnull) {
+        total_blocks = -1;
+    }
+
+    op = find_operation(opname);
+    if (flagstr) {
+        flags = parse_constant_multi(op->scope, flagstr);
+    }
+    if (op->scope != SCOPE_IDNA2) {
+        check_stringprep();
+    }
+    backfill_check_relation(relid, source, target, &source_attnum, &target_attnum);
+
+    rel = heap_open(relid, RowExclusiveLock);
+    tupdesc = RelationGetDescr(rel);
+    nblocks = RelationGetNumberOfBlocks(rel);
+
+    if (strcmp(status, "pending") == 0) {
+        Oid claimtypes[3] = { INT4OID, INT4OID, INT8OID };
+        Datum claimargs[3];
+
+        if (total_blocks < 0) {
+            total_blocks = nblocks;
+        }
+        claimargs[0] = Int32GetDatum(job_id);
+        claimargs[1] = Int32GetDatum(MyProcPid);
+        claimargs[2] = Int64GetDatum(total_blocks);
+        rc = SPI_execute_with_args(psprintf("UPDATE %s SET status = 'running', worker_pid = $2, "
+                                            "total_blocks = $3, "
+                                            "started_at = coalesce(started_at, now()), "
+                                            "updated_at = now() WHERE job_id = $1", jobs),
+                                   3, claimtypes, claimargs, NULL, false, 0);
+        if (rc != SPI_OK_UPDATE) {
+            elog(ERROR, "idn backfill: SPI_execute_with_args returned %d", rc);
+        }
+    }
+
+    /* the table may have been truncated by VACUUM since the job started */
+    if (total_blocks < nblocks) {
+        nblocks = (BlockNumber) total_blocks;
+    }
+    numblks = 0;
+    if (next_block < nblocks) {
+        numblks = Min((BlockNumber) batch_pages, nblocks - (BlockNumber) next_block);
+    }
+
+    ntids = 0;
+    maxtids = 1024;
+    tids = palloc(sizeof(Datum) * maxtids);
+    sources = palloc(sizeof(Datum) * maxtids);
+    source_nulls = palloc(sizeof(bool) * maxtids);
+    values = palloc(sizeof(Datum) * maxtids);
+    value_nulls = palloc(sizeof(bool) * maxtids);
+
+    if (numblks > 0) {
+        scan = heap_beginscan_strat(rel, GetActiveSnapshot(), 0, NULL, true, false);
+        heap_setscanlimits(scan, (BlockNumber) next_block, numblks);
+        while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL) {
+            Datum d, current;
+            bool current_isnull;
+            text *value = NULL, *res = NULL;
+            char *utf8_src;
+            size_t utf8_srclen;
+            bool needs_free;
+            ItemPointer tid;
+
+            /* a NULL source gets a NULL target, as with idn_sync_columns */
+            d = heap_getattr(tuple, source_attnum, tupdesc, &isnull);
+            if (!isnull) {
+                /* the tuple is only good until the next fetch */
+                value = (text *) PG_DETOAST_DATUM_COPY(d);
+                utf8_src = text_to_utf8(value, &utf8_srclen, &needs_free, true);
+                res = run_operation(op, flags, utf8_src, &rc);
+                if (needs_free) {
+                    pfree(utf8_src);
+                }
+                if (res == NULL) {
+                    failed++;
+                }
+            }
+
+            current = heap_getattr(tuple, target_attnum, tupdesc, &current_isnull);
+            if (!backfill_differs(res, current, current_isnull)) {
+                if (value) {
+                    pfree(value);
+                }
+                if (res) {
+                    pfree(res);
+                }
+                continue;
+            }
+
+            if (ntids == maxtids) {
+                maxtids *= 2;
+                tids = repalloc(tids, sizeof(Datum) * maxtids);
+                sources = repalloc(sources, sizeof(Datum) * maxtids);
+                source_nulls = repalloc(source_nulls, sizeof(bool) * maxtids);
+                values = repalloc(values, sizeof(Datum) * maxtids);
+                value_nulls = repalloc(value_nulls, sizeof(bool) * maxtids);
+            }
+            tid = palloc(sizeof(ItemPointerData));
+            ItemPointerCopy(&tuple->t_self, tid);
+            tids[ntids] = PointerGetDatum(tid);
+            sources[ntids] = PointerGetDatum(value);
+            source_nulls[ntids] = (value == NULL);
+            values[ntids] = PointerGetDatum(res);
+            value_nulls[ntids] = (res == NULL);
+            ntids++;
+        }
+        heap_endscan(scan);
+    }
+
+    if (ntids > 0) {
+        /* UPDATE ONLY rel AS t SET tgt = v.val
+         *   FROM unnest($1, $2, $3) AS v(tid, src, val)
+         *   WHERE t.ctid = ANY($1) AND t.ctid = v.tid
+         *     AND t.src IS NOT DISTINCT FROM v.src
+         *
+         * ctid = ANY() gets a TID scan; the source check skips rows which
+         * were updated since we read them.
+         */
+        dims[0] = ntids;
+        lbs[0] = 1;
+        argtypes[0] = get_array_type(TIDOID);
+        args[0] = PointerGetDatum(construct_array(tids, ntids, TIDOID,
+                                                  sizeof(ItemPointerData), false, 's'));
+        argtypes[1] = TEXTARRAYOID;
+        args[1] = PointerGetDatum(construct_md_array(sources, source_nulls, 1, dims, lbs,
+                                                     TEXTOID, -1, false, 'i'));
+        argtypes[2] = TEXTARRAYOID;
+        args[2] = PointerGetDatum(construct_md_array(values, value_nulls, 1, dims, lbs,
+                                                     TEXTOID, -1, false, 'i'));
+        rc = SPI_execute_with_args(psprintf("UPDATE ONLY %s AS t SET %s = v.val "
+                                            "FROM unnest($1, $2, $3) AS v(tid, src, val) "
+                                            "WHERE t.ctid = ANY($1) AND t.ctid = v.tid "
+                                            "AND t.%s IS NOT DISTINCT FROM v.src",
+                                            quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)),
+                                                                       RelationGetRelationName(rel)),
+                                            quote_identifier(target), quote_identifier(source)),
+                                   3, argtypes, args, NULL, false, 0);
+        if (rc != SPI_OK_UPDATE) {
+            elog(ERROR, "idn backfill: SPI_execute_with_args returned %d", rc);
+        }
+        updated = SPI_processed;
+    }
+
+    heap_close(rel, NoLock);
+
+    next_block += numblks;
+    done = (next_block >= nblocks);
+
+    argtypes[0] = INT4OID;
+    args[0] = Int32GetDatum(job_id);
+    argtypes[1] = INT8OID;
+    args[1] = Int64GetDatum(next_block);
+    argtypes[2] = INT8OID;
+    args[2] = Int64GetDatum(updated);
+    argtypes[3] = INT8OID;
+    args[3] = Int64GetDatum(failed);
+    argtypes[4] = BOOLOID;
+    args[4] = BoolGetDatum(done);
+    rc = SPI_execute_with_args(psprintf("UPDATE %s SET next_block = $2, "
+                                        "rows_updated = rows_updated + $3, "
+                                        "rows_failed = rows_failed + $4, updated_at = now(), "
+                                        "status = CASE WHEN $5 THEN 'done' ELSE status END, "
+                                        "finished_at = CASE WHEN $5 THEN now() END "
+                                        "WHERE job_id = $1", jobs),
+                               5, argtypes, args, NULL, false, 0);
+    if (rc != SPI_OK_UPDATE) {
+        elog(ERROR, "idn backfill: SPI_execute_with_args returned %d", rc);
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    return !done;
+}
+
+/* record an error against the job, in a fresh transaction */
+static void
+backfill_fail(int32 job_id, const char *message)
+{
+    Oid argtypes[3] = { INT4OID, TEXTOID, INT4OID };
+    Datum args[3];
+    int rc;
+
+    StartTransactionCommand();
+    if ((rc = SPI_connect()) != SPI_OK_CONNECT) {
+        elog(ERROR, "idn backfill: SPI_connect returned %d", rc);
+    }
+    PushActiveSnapshot(GetTransactionSnapshot());
+
+    args[0] = Int32GetDatum(job_id);
+    args[1] = CStringGetTextDatum(message);
+    args[2] = Int32GetDatum(MyProcPid);
+    rc = SPI_execute_with_args(psprintf("UPDATE %s SET status = 'failed', error = $2, "
+                                        "finished_at = now() "
+                                        "WHERE job_id = $1 AND worker_pid = $3",
+                                        backfill_jobs_table()),
+                               3, argtypes, args, NULL, false, 0);
+    if (rc != SPI_OK_UPDATE) {
+        elog(ERROR, "idn backfill: SPI_execute_with_args returned %d", rc);
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+}
+
+void
+idn_backfill_main(Datum main_arg)
+{
+    int32 job_id = DatumGetInt32(main_arg);
+    struct backfill_launch launch;
+    MemoryContext worker_context;
+    bool more = true;
+    int delay = 0;
+
+    memcpy(&launch, MyBgworkerEntry->bgw_extra, sizeof(struct backfill_launch));
+
+    /* SIGTERM ends the worker at the next CHECK_FOR_INTERRUPTS; the batch
+     * in progress rolls back and the job can be resumed
+     */
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    BackgroundWorkerInitializeConnectionByOid(launch.dboid, launch.roleoid, 0);
+
+    worker_context = AllocSetContextCreate(TopMemoryContext, "idn backfill",
+                                           ALLOCSET_DEFAULT_SIZES);
+    MemoryContextSwitchTo(worker_context);
+
+    while (more) {
+        SetCurrentStatementStartTimestamp();
+        StartTransactionCommand();
+        pgstat_report_activity(STATE_RUNNING, "idn backfill batch");
+
+        PG_TRY();
+        {
+            more = backfill_batch(job_id, &delay);
+        }
+        PG_CATCH();
+        {
+            ErrorData *edata;
+
+            MemoryContextSwitchTo(worker_context);
+            EmitErrorReport();
+            edata = CopyErrorData();
+            FlushErrorState();
+            AbortCurrentTransaction();
+            backfill_fail(job_id, edata->message);
+            proc_exit(1);
+        }
+        PG_END_TRY();
+
+        CommitTransactionCommand();
+        MemoryContextSwitchTo(worker_context);
+        pgstat_report_stat(false);
+        pgstat_report_activity(STATE_IDLE, NULL);
+
+        if (more && delay > 0) {
+            int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                               delay, PG_WAIT_EXTENSION);
+
+            ResetLatch(MyLatch);
+            if (rc & WL_POSTMASTER_DEATH) {
+                proc_exit(1);
+            }
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+
+    proc_exit(0);
+}
+
+/*
+ * Brand matching.
+ *
+ * idn_brand_match(name, patterns) returns the positions in patterns of
+ * every pattern found as a substring of the name, in ascending order.
+ * Name and patterns are compared in a common form: the UTS#46-mapped
+ * name (lower case, NFC, deviations kept) decoded to U-labels, and the
+ * name is also matched as A-labels, so both "bücher" and "bcher-kva" can
+ * be found in "XN--BCHER-KVA.de". Anything UTS#46 rejects is compared as
+ * its NFKC form with ASCII letters lowered instead.
+ *
+ * The patterns are compiled into an Aho-Corasick automaton over UTF-8
+ * bytes, so matching is linear in the length of the name whatever the
+ * number of patterns. Automata are cached per backend, keyed by a hash
+ * of the pattern array; a pattern array which is a constant or a bind
+ * parameter is only hashed on the first call of each query.
+ */
+
+#define BRAND_CACHE_SIZE 4
+
+typedef struct BrandMatcher {
+    uint64 hash; /* identity of the pattern array: hash, size and contents */
+    Size size;
+    char *key;
+    MemoryContext context;
+    int lbound; /* pattern ids are lbound .. lbound + npatterns - 1 */
+    int npatterns;
+    int nnodes;
+    int32 root[256]; /* dense transitions out of the root; 0 if none */
+    int32 *edge_start; /* CSR: node n's edges are edge_start[n] .. edge_start[n + 1] */
+    uint8 *edge_byte; /* sorted within each node */
+    int32 *edge_target;
+    int32 *fail;
+    int32 *dict; /* nearest state on the fail chain with outputs; 0 if none */
+    int32 *out_start; /* node n's pattern indexes are out_start[n] .. out_start[n + 1] */
+    int32 *out_ids;
+    uint32 *seen; /* per pattern, the last generation which matched it */
+    uint32 generation;
+    int32 *found; /* scratch: indexes of the patterns matched by one name */
+} BrandMatcher;
+
+static BrandMatcher *brand_cache[BRAND_CACHE_SIZE];
+
+/* set in fn_extra when the pattern argument cannot change within a query */
+struct brand_fn_cache {
+    uint64 hash;
+    Size size;
+};
+
+/* the comparison forms of a UTF-8 string, malloc()ed; *aform is NULL
+ * when UTS#46 rejects the input
+ */
+static void
+brand_forms(const char *src, char **uform, char **aform)
+{
+    size_t i, len;
+    char *res;
+
+    *uform = NULL;
+    *aform = NULL;
+    if (op_uts46_lookup(src, aform, 0) == IDN2_OK) {
+        if (op_idn2_to_unicode(*aform, uform, 0) == IDN2_OK) {
+            return;
+        }
+        *uform = strdup(*aform);
+        if (*uform == NULL) {
+            free(*aform);
+            ereport(ERROR,
+                    (errcode(ERRCODE_OUT_OF_MEMORY),
+                     errmsg("out of memory")));
+        }
+        return;
+    }
+
+    check_stringprep();
+    if (op_nfkc_normalize(src, &res, 0) != 0) {
+        res = strdup(src);
+    }
+    if (res == NULL) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OUT_OF_MEMORY),
+                 errmsg("out of memory")));
+    }
+    len = strlen(res);
+    for (i = 0; i < len; ++i) {
+        res[i] = pg_ascii_tolower((unsigned char) res[i]);
+    }
+    *uform = res;
+}
+
+static int32
+brand_goto(const BrandMatcher *m, int32 state, uint8 c)
+{
+    int32 lo, hi;
+
+    if (state == 0) {
+        return m->root[c] ? m->root[c] : -1;
+    }
+    lo = m->edge_start[state];
+    hi = m->edge_start[state + 1] - 1;
+    while (lo <= hi) {
+        int32 mid = (lo + hi) / 2;
+
+        if (m->edge_byte[mid] == c) {
+            return m->edge_target[mid];
+        } else if (m->edge_byte[mid] < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+static BrandMatcher *
+brand_compile(ArrayType *patterns, uint64 hash, Size size)
+{
+    MemoryContext context, oldcontext;
+    BrandMatcher *m;
+    Datum *elems;
+    bool *nulls;
+    int nelems, i, j;
+    /* the trie while it is built: edges as per-node linked lists */
+    int32 *first_edge, *edge_next, *edge_to, *out_next, *out_head, *queue;
+    uint8 *edge_by;
+    int maxnodes, nedges, nouts, head, tail;
+
+    /* only kept, under TopMemoryContext, once the matcher is complete */
+    context = AllocSetContextCreate(CurrentMemoryContext, "idn brand matcher",
+                                    ALLOCSET_DEFAULT_SIZES);
+    oldcontext = MemoryContextSwitchTo(context);
+
+    m = palloc0(sizeof(BrandMatcher));
+    m->hash = hash;
+    m->size = size;
+    m->key = palloc(size);
+    memcpy(m->key, patterns, size);
+    m->context = context;
+
+    deconstruct_array(patterns, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+    m->lbound = (ARR_NDIM(patterns) > 0) ? ARR_LBOUND(patterns)[0] : 1;
+    m->npatterns = nelems;
+
+    maxnodes = 1024;
+    first_edge = palloc(sizeof(int32) * maxnodes);
+    out_head = palloc(sizeof(int32) * maxnodes);
+    edge_next = palloc(sizeof(int32) * maxnodes);
+    edge_to = palloc(sizeof(int32) * maxnodes);
+    edge_by = palloc(sizeof(uint8) * maxnodes);
+    out_next = palloc(sizeof(int32) * (nelems + 1));
+    first_edge[0] = -1;
+    out_head[0] = -1;
+    m->nnodes = 1;
+    nedges = 0;
+    nouts = 0;
+
+    for (i = 0; i < nelems; ++i) {
+        char *utf8_src, *uform, *aform;
+        size_t utf8_srclen, len, k;
+        bool needs_free;
+        int32 state = 0;
+
+        if (nulls[i]) {
+            continue;
+        }
+        utf8_src = text_to_utf8(DatumGetTextPP(elems[i]), &utf8_srclen, &needs_free, true);
+        brand_forms(utf8_src, &uform, &aform);
+        if (needs_free) {
+            pfree(utf8_src);
+        }
+        free(aform);
+
+        len = strlen(uform);
+        for (k = 0; k < len; ++k) {
+            uint8 c = (uint8) uform[k];
+            int32 e;
+
+            for (e = first_edge[state]; e >= 0; e = edge_next[e]) {
+                if (edge_by[e] == c) {
+                    break;
+                }
+            }
+            if (e >= 0) {
+                state = edge_to[e];
+                continue;
+            }
+            /* every node but the root has exactly one incoming edge */
+            if (m->nnodes == maxnodes) {
+                maxnodes *= 2;
+                first_edge = repalloc(first_edge, sizeof(int32) * maxnodes);
+                out_head = repalloc(out_head, sizeof(int32) * maxnodes);
+                edge_next = repalloc(edge_next, sizeof(int32) * maxnodes);
+                edge_to = repalloc(edge_to, sizeof(int32) * maxnodes);
+                edge_by = repalloc(edge_by, sizeof(uint8) * maxnodes);
+            }
+            first_edge[m->nnodes] = -1;
+            out_head[m->nnodes] = -1;
+            edge_by[nedges] = c;
+            edge_to[nedges] = m->nnodes;
+            edge_next[nedges] = first_edge[state];
+            first_edge[state] = nedges++;
+            state = m->nnodes++;
+        }
+        free(uform);
+
+        /* an empty pattern would match everything; ignore it */
+        if (state != 0) {
+            out_next[i] = out_head[state];
+            out_head[state] = i;
+            nouts++;
+        }
+    }
+
+    /* flatten into CSR form, edges sorted by byte */
+    m->edge_start = palloc(sizeof(int32) * (m->nnodes + 1));
+    m->edge_byte = palloc(sizeof(uint8) * Max(nedges, 1));
+    m->edge_target = palloc(sizeof(int32) * Max(nedges, 1));
+    m->out_start = palloc(sizeof(int32) * (m->nnodes + 1));
+    m->out_ids = palloc(sizeof(int32) * Max(nouts, 1));
+    nedges = 0;
+    nouts = 0;
+    for (i = 0; i < m->nnodes; ++i) {
+        int32 e;
+        int start = nedges;
+
+        m->edge_start[i] = nedges;
+        for (e = first_edge[i]; e >= 0; e = edge_next[e]) {
+            /* insertion sort; nodes past the first few levels have few edges */
+            for (j = nedges; j > start && m->edge_byte[j - 1] > edge_by[e]; --j) {
+                m->edge_byte[j] = m->edge_byte[j - 1];
+                m->edge_target[j] = m->edge_target[j - 1];
+            }
+            m->edge_byte[j] = edge_by[e];
+            m->edge_target[j] = edge_to[e];
+            nedges++;
+        }
+        m->out_start[i] = nouts;
+        for (e = out_head[i]; e >= 0; e = out_next[e]) {
+            m->out_ids[nouts++] = e;
+        }
+    }
+    m->edge_start[m->nnodes] = nedges;
+    m->out_start[m->nnodes] = nouts;
+    memset(m->root, 0, sizeof(m->root));
+    for (j = m->edge_start[0]; j < m->edge_start[1]; ++j) {
+        m->root[m->edge_byte[j]] = m->edge_target[j];
+    }
+    pfree(first_edge);
+    pfree(out_head);
+    pfree(edge_next);
+    pfree(edge_to);
+    pfree(edge_by);
+    pfree(out_next);
+
+    /* fail and dictionary links, breadth first */
+    m->fail = palloc0(sizeof(int32) * m->nnodes);
+    m->dict = palloc0(sizeof(int32) * m->nnodes);
+    queue = palloc(sizeof(int32) * m->nnodes);
+    head = tail = 0;
+    for (j = m->edge_start[0]; j < m->edge_start[1]; ++j) {
+        queue[tail++] = m->edge_target[j];
+    }
+    while (head < tail) {
+        int32 u = queue[head++];
+
+        for (j = m->edge_start[u]; j < m->edge_start[u + 1]; ++j) {
+            int32 v = m->edge_target[j];
+            uint8 c = m->edge_byte[j];
+            int32 f = m->fail[u], next;
+
+            while ((next = brand_goto(m, f, c)) < 0 && f != 0) {
+                f = m->fail[f];
+            }
+            m->fail[v] = (next >= 0) ? next : 0;
+            f = m->fail[v];
+            m->dict[v] = (m->out_start[f] < m->out_start[f + 1]) ? f : m->dict[f];
+            queue[tail++] = v;
+        }
+    }
+    pfree(queue);
+
+    m->seen = palloc0(sizeof(uint32) * Max(nelems, 1));
+    m->generation = 0;
+    m->found = palloc(sizeof(int32) * Max(nelems, 1));
+
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextSetParent(context, TopMemoryContext);
+    return m;
+}
+
+/* find or build the matcher for a pattern array, most recently used first;
+ * without the array itself, only an existing matcher can be found
+ */
+static BrandMatcher *
+brand_lookup(ArrayType *patterns, uint64 hash, Size size)
+{
+    BrandMatcher *m;
+    int i;
+
+    for (i = 0; i < BRAND_CACHE_SIZE && brand_cache[i]; ++i) {
+        if (brand_cache[i]->hash == hash && brand_cache[i]->size == size &&
+            (patterns == NULL || memcmp(brand_cache[i]->key, patterns, size) == 0)) {
+            break;
+        }
+    }
+    if (i < BRAND_CACHE_SIZE && brand_cache[i]) {
+        m = brand_cache[i];
+    } else {
+        if (patterns == NULL) {
+            return NULL;
+        }
+        m = brand_compile(patterns, hash, size);
+        i = BRAND_CACHE_SIZE - 1;
+        if (brand_cache[i]) {
+            MemoryContextDelete(brand_cache[i]->context);
+        }
+    }
+    memmove(&brand_cache[1], &brand_cache[0], sizeof(BrandMatcher *) * i);
+    brand_cache[0] = m;
+    return m;
+}
+
+static void
+brand_scan(BrandMatcher *m, const char *s, int *nfound)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    int32 state = 0;
+
+    for (; *p; ++p) {
+        int32 next, o, k;
+
+        while ((next = brand_goto(m, state, *p)) < 0 && state != 0) {
+            state = m->fail[state];
+        }
+        state = (next >= 0) ? next : 0;
+
+        o = (m->out_start[state] < m->out_start[state + 1]) ? state : m->dict[state];
+        for (; o > 0; o = m->dict[o]) {
+            for (k = m->out_start[o]; k < m->out_start[o + 1]; ++k) {
+                int32 id = m->out_ids[k];
+
+                if (m->seen[id] != m->generation) {
+                    m->seen[id] = m->generation;
+                    m->found[(*nfound)++] = id;
+                }
+            }
+        }
+    }
+}
+
+static int
+brand_id_compare(const void *a, const void *b)
+{
+    int32 x = *(const int32 *) a, y = *(const int32 *) b;
+
+    return (x > y) - (x < y);
+}
+
+Datum idn_brand_match(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_brand_match);
+Datum idn_brand_match(PG_FUNCTION_ARGS)
+{
+    struct brand_fn_cache *fn_cache = (struct brand_fn_cache *) fcinfo->flinfo->fn_extra;
+    BrandMatcher *m = NULL;
+    ArrayType *patterns = NULL;
+    char *utf8_src, *uform, *aform;
+    size_t utf8_srclen;
+    bool needs_free;
+    Datum *ids;
+    int nfound = 0;
+    int i;
+
+    if (PG_NARGS() != 2) {
+        elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+    /* while the function is defined as strict, this belts-and-suspenders
+     * doesn't hurt
+     */
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) {
+        PG_RETURN_NULL();
+    }
+
+    if (fn_cache) {
+        m = brand_lookup(NULL, fn_cache->hash, fn_cache->size);
+    }
+    if (m == NULL) {
+        uint64 hash;
+        Size size;
+
+        patterns = PG_GETARG_ARRAYTYPE_P(1);
+        if (ARR_NDIM(patterns) > 1) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                     errmsg("idn_brand_match patterns must be a one-dimensional array")));
+        }
+        size = VARSIZE(patterns);
+        hash = DatumGetUInt64(hash_any_extended((unsigned char *) patterns, size, 0));
+        m = brand_lookup(patterns, hash, size);
+
+        if (fn_cache == NULL && get_fn_expr_arg_stable(fcinfo->flinfo, 1)) {
+            fn_cache = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt, sizeof(struct brand_fn_cache));
+            fcinfo->flinfo->fn_extra = fn_cache;
+        }
+        if (fn_cache) {
+            fn_cache->hash = hash;
+            fn_cache->size = size;
+        }
+    }
+
+    utf8_src = text_to_utf8(PG_GETARG_TEXT_PP(0), &utf8_srclen, &needs_free, true);
+    brand_forms(utf8_src, &uform, &aform);
+    if (needs_free) {
+        pfree(utf8_src);
+    }
+
+    if (++m->generation == 0) {
+        /* wrapped around: forget everything seen so far */
+        memset(m->seen, 0, sizeof(uint32) * Max(m->npatterns, 1));
+        m->generation = 1;
+    }
+    brand_scan(m, uform, &nfound);
+    if (aform && strcmp(aform, uform) != 0) {
+        brand_scan(m, aform, &nfound);
+    }
+    free(uform);
+    free(aform);
+
+    qsort(m->found, nfound, sizeof(int32), brand_id_compare);
+    ids = palloc(sizeof(Datum) * Max(nfound, 1));
+    for (i = 0; i < nfound; ++i) {
+        ids[i] = Int32GetDatum(m->found[i] + m->lbound);
+    }
+    PG_RETURN_ARRAYTYPE_P(construct_array(ids, nfound, INT4OID, sizeof(int32), true, 'i'));
+}
+
+/*
+ * Typosquatting candidates.
+ *
+ * idn_variants(name, kinds) varies the first label of the name, after
+ * UTS#46 mapping, and returns every variant which converts with
+ * idn2_lookup, once, as an A-label name. Variants which do not convert
+ * are dropped without a WARNING. Variants are generated one at a time, as
+ * rows are fetched; only the hashes of the names already returned are
+ * kept, so that duplicates (and the name itself) are skipped.
+ */
+
+struct variant_kind {
+    int flag;
+    const char *name;
+};
+
+/* in the order they are generated */
+static const struct variant_kind _variant_kinds[] = {
+    {IDN_VARIANT_OMISSION, "omission"},
+    {IDN_VARIANT_INSERTION, "insertion"},
+    {IDN_VARIANT_TRANSPOSITION, "transposition"},
+    {IDN_VARIANT_ADJACENT_KEY, "adjacent_key"},
+    {IDN_VARIANT_HOMOGLYPH, "homoglyph"},
+    {IDN_VARIANT_SCRIPT_SWAP, "script_swap"},
+};
+
+#define NUM_VARIANT_KINDS (sizeof(_variant_kinds) / sizeof(struct variant_kind))
+
+/* what insertion inserts */
+static const char variant_ldh[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
+
+/* QWERTY neighbours of a-z, then 0-9 */
+static const char *const variant_keys[36] = {
+    "qwsz", "vghn", "xdfv", "erfcxs", "34rdsw", "rtgvcd", "tyhbvf",
+    "yujnbg", "89okju", "uikmnh", "iolmj", "opk", "njk", "bhjm",
+    "90plki", "0lo", "12wa", "45tfde", "wedxza", "56ygfr", "78ijhy",
+    "cfgb", "23esaq", "zsdc", "67uhgt", "asx",
+    "9po", "2q", "13wq", "24ew", "35re", "46tr", "57yt", "68uy", "79iu", "80oi",
+};
+
+#define VARIANT_SCRIPT_ASCII 'A' /* same-script look-alikes, for homoglyph only */
+#define VARIANT_SCRIPT_CYRILLIC 'C'
+#define VARIANT_SCRIPT_GREEK 'G'
+#define VARIANT_SCRIPT_LATIN 'L' /* script swap back from Cyrillic or Greek */
+
+/* look-alike pairs; homoglyph uses them both ways */
+static const struct homoglyph {
+    pg_wchar latin;
+    pg_wchar other;
+    char script;
+} _homoglyphs[] = {
+    {'a', 0x0430, VARIANT_SCRIPT_CYRILLIC},
+    {'c', 0x0441, VARIANT_SCRIPT_CYRILLIC},
+    {'d', 0x0501, VARIANT_SCRIPT_CYRILLIC},
+    {'e', 0x0435, VARIANT_SCRIPT_CYRILLIC},
+    {'h', 0x04BB, VARIANT_SCRIPT_CYRILLIC},
+    {'i', 0x0456, VARIANT_SCRIPT_CYRILLIC},
+    {'j', 0x0458, VARIANT_SCRIPT_CYRILLIC},
+    {'l', 0x04CF, VARIANT_SCRIPT_CYRILLIC},
+    {'o', 0x043E, VARIANT_SCRIPT_CYRILLIC},
+    {'p', 0x0440, VARIANT_SCRIPT_CYRILLIC},
+    {'q', 0x051B, VARIANT_SCRIPT_CYRILLIC},
+    {'s', 0x0455, VARIANT_SCRIPT_CYRILLIC},
+    {'w', 0x051D, VARIANT_SCRIPT_CYRILLIC},
+    {'x', 0x0445, VARIANT_SCRIPT_CYRILLIC},
+    {'y', 0x0443, VARIANT_SCRIPT_CYRILLIC},
+    {'a', 0x03B1, VARIANT_SCRIPT_GREEK},
+    {'i', 0x03B9, VARIANT_SCRIPT_GREEK},
+    {'k', 0x03BA, VARIANT_SCRIPT_GREEK},
+    {'n', 0x03B7, VARIANT_SCRIPT_GREEK},
+    {'o', 0x03BF, VARIANT_SCRIPT_GREEK},
+    {'p', 0x03C1, VARIANT_SCRIPT_GREEK},
+    {'t', 0x03C4, VARIANT_SCRIPT_GREEK},
+    {'u', 0x03C5, VARIANT_SCRIPT_GREEK},
+    {'v', 0x03BD, VARIANT_SCRIPT_GREEK},
+    {'x', 0x03C7, VARIANT_SCRIPT_GREEK},
+    {'y', 0x03B3, VARIANT_SCRIPT_GREEK},
+    {'i', '1', VARIANT_SCRIPT_ASCII},
+    {'l', '1', VARIANT_SCRIPT_ASCII},
+    {'l', 'i', VARIANT_SCRIPT_ASCII},
+    {'o', '0', VARIANT_SCRIPT_ASCII},
+};
+
+#define NUM_HOMOGLYPHS (sizeof(_homoglyphs) / sizeof(struct homoglyph))
+
+/* the scripts a whole label can be swapped to */
+static const char variant_scripts[] = {
+    VARIANT_SCRIPT_CYRILLIC,
+    VARIANT_SCRIPT_GREEK,
+    VARIANT_SCRIPT_LATIN,
+};
+
+struct variants_state {
+    int kinds;
+    pg_wchar *label; /* the first label, decoded */
+    int len;
+    char *rest; /* the rest of the name, from the first dot; UTF-8 */
+    pg_wchar *cand; /* the current candidate label */
+    int candlen;
+    /* cursor: the next candidate is the one after (kind, pos, alt) */
+    int kind;
+    int pos;
+    int alt;
+    StringInfoData buf;
+    HTAB *seen; /* the names returned so far */
+    MemoryContext context; /* holds the names in seen */
+};
+
+/* one entry per name in seen */
+struct variant_entry {
+    char *name; /* must be first */
+};
+
+static uint32
+variant_entry_hash(const void *key, Size keysize)
+{
+    const char *name = *((char * const *) key);
+
+    return DatumGetUInt32(hash_any((const unsigned char *) name, strlen(name)));
+}
+
+static int
+variant_entry_match(const void *key1, const void *key2, Size keysize)
+{
+    return strcmp(*((char * const *) key1), *((char * const *) key2));
+}
+
+/* true if name was not seen before, and remember it */
+static bool
+variant_remember(struct variants_state *st, const char *name)
+{
+    struct variant_entry *entry;
+    bool found;
+
+    entry = hash_search(st->seen, &name, HASH_ENTER, &found);
+    if (!found) {
+        /* the key was only borrowed */
+        entry->name = MemoryContextStrdup(st->context, name);
+    }
+    return !found;
+}
+
+/* spell the whole label in script; false if some letter has no look-alike there */
+static bool
+variant_swap_script(struct variants_state *st, char script)
+{
+    int i, j;
+
+    for (i = 0; i < st->len; ++i) {
+        pg_wchar c = st->label[i];
+
+        if ((c >= '0' && c <= '9') || c == '-') {
+            st->cand[i] = c;
+            continue;
+        }
+        for (j = 0; j < NUM_HOMOGLYPHS; ++j) {
+            if (_homoglyphs[j].script == VARIANT_SCRIPT_ASCII) {
+                continue;
+            }
+            if (script == VARIANT_SCRIPT_LATIN) {
+                if (_homoglyphs[j].other == c) {
+                    st->cand[i] = _homoglyphs[j].latin;
+                    break;
+                }
+            } else if (_homoglyphs[j].script == script) {
+                if (_homoglyphs[j].latin == c) {
+                    st->cand[i] = _homoglyphs[j].other;
+                    break;
+                }
+            }
+        }
+        if (j == NUM_HOMOGLYPHS) {
+            /* already in the target script, if it's Latin */
+            if (script != VARIANT_SCRIPT_LATIN || c >= 0x80) {
+                return false;
+            }
+            st->cand[i] = c;
+        }
+    }
+    st->candlen = st->len;
+    return memcmp(st->cand, st->label, sizeof(pg_wchar) * st->len) != 0;
+}
+
+/* advance the cursor to the next candidate label; false when there are none left */
+static bool
+variant_next(struct variants_state *st)
+{
+    for (; st->kind < NUM_VARIANT_KINDS; st->kind++, st->pos = 0, st->alt = 0) {
+        int flag = _variant_kinds[st->kind].flag;
+
+        if (!(st->kinds & flag)) {
+            continue;
+        }
+        switch (flag) {
+            case IDN_VARIANT_OMISSION:
+                /* a one-character label would become empty */
+                if (st->len > 1 && st->pos < st->len) {
+                    int p = st->pos++;
+
+                    memcpy(st->cand, st->label, sizeof(pg_wchar) * p);
+                    memcpy(st->cand + p, st->label + p + 1, sizeof(pg_wchar) * (st->len - p - 1));
+                    st->candlen = st->len - 1;
+                    return true;
+                }
+                break;
+            case IDN_VARIANT_INSERTION:
+                while (st->pos <= st->len) {
+                    if (st->alt < sizeof(variant_ldh) - 1) {
+                        int p = st->pos;
+
+                        memcpy(st->cand, st->label, sizeof(pg_wchar) * p);
+                        st->cand[p] = (pg_wchar) variant_ldh[st->alt++];
+                        memcpy(st->cand + p + 1, st->label + p, sizeof(pg_wchar) * (st->len - p));
+                        st->candlen = st->len + 1;
+                        return true;
+                    }
+                    st->pos++;
+                    st->alt = 0;
+                }
+                break;
+            case IDN_VARIANT_TRANSPOSITION:
+                while (st->pos < st->len - 1) {
+                    int p = st->pos++;
+
+                    if (st->label[p] == st->label[p + 1]) {
+                        continue;
+                    }
+                    memcpy(st->cand, st->label, sizeof(pg_wchar) * st->len);
+                    st->cand[p] = st->label[p + 1];
+                    st->cand[p + 1] = st->label[p];
+                    st->candlen = st->len;
+                    return true;
+                }
+                break;
+            case IDN_VARIANT_ADJACENT_KEY:
+                while (st->pos < st->len) {
+                    pg_wchar c = st->label[st->pos];
+                    const char *keys = NULL;
+
+                    if (c >= 'a' && c <= 'z') {
+                        keys = variant_keys[c - 'a'];
+                    } else if (c >= '0' && c <= '9') {
+                        keys = variant_keys[26 + c - '0'];
+                    }
+                    if (keys && keys[st->alt] != '\0') {
+                        memcpy(st->cand, st->label, sizeof(pg_wchar) * st->len);
+                        st->cand[st->pos] = (pg_wchar) keys[st->alt++];
+                        st->candlen = st->len;
+                        return true;
+                    }
+                    st->pos++;
+                    st->alt = 0;
+                }
+                break;
+            case IDN_VARIANT_HOMOGLYPH:
+                while (st->pos < st->len) {
+                    pg_wchar c = st->label[st->pos];
+
+                    while (st->alt < NUM_HOMOGLYPHS) {
+                        const struct homoglyph *h = &_homoglyphs[st->alt++];
+                        pg_wchar r;
+
+                        if (h->latin == c) {
+                            r = h->other;
+                        } else if (h->other == c) {
+                            r = h->latin;
+                        } else {
+                            continue;
+                        }
+                        memcpy(st->cand, st->label, sizeof(pg_wchar) * st->len);
+                        st->cand[st->pos] = r;
+                        st->candlen = st->len;
+                        return true;
+                    }
+                    st->pos++;
+                    st->alt = 0;
+                }
+                break;
+            case IDN_VARIANT_SCRIPT_SWAP:
+                while (st->pos < sizeof(variant_scripts)) {
+                    if (variant_swap_script(st, variant_scripts[st->pos++])) {
+                        return true;
+                    }
+                }
+                break;
+        }
+    }
+    return false;
+}
+
+/* the A-label name for the current candidate, if it converts and is new; malloc()ed */
+static char *
+variant_convert(struct variants_state *st)
+{
+    unsigned char utf8[MAX_MULTIBYTE_CHAR_LEN];
+    char *dest;
+    int i;
+
+    /* plain IDNA2008 passes ASCII labels through, so check the hyphen
+     * rule (RFC 5891, section 4.2.3.1) here
+     */
+    if (st->candlen > 0 && (st->cand[0] == '-' || st->cand[st->candlen - 1] == '-')) {
+        return NULL;
+    }
+
+    resetStringInfo(&st->buf);
+    for (i = 0; i < st->candlen; ++i) {
+        unicode_to_utf8(st->cand[i], utf8);
+        appendBinaryStringInfo(&st->buf, (char *) utf8, pg_utf_mblen(utf8));
+    }
+    appendStringInfoString(&st->buf, st->rest);
+
+    if (op_idn2_lookup(st->buf.data, &dest, 0) != IDN2_OK) {
+        return NULL;
+    }
+    if (!variant_remember(st, dest)) {
+        free(dest);
+        return NULL;
+    }
+    return dest;
+}
+
+Datum idn_variants(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_variants);
+Datum idn_variants(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    struct variants_state *st;
+
+    if (SRF_IS_FIRSTCALL()) {
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        HASHCTL ctl;
+        char *utf8_src, *aform, *uform, *dot;
+        const unsigned char *p, *end;
+        size_t utf8_srclen;
+        bool needs_free;
+        int rc;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+
+        if (PG_ARGISNULL(0)) {
+            SRF_RETURN_DONE(funcctx);
+        }
+
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+            elog(ERROR, "return type must be a row type");
+        }
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        st = palloc0(sizeof(struct variants_state));
+        st->kinds = IDN_VARIANT_OMISSION | IDN_VARIANT_INSERTION | IDN_VARIANT_TRANSPOSITION |
+                    IDN_VARIANT_ADJACENT_KEY | IDN_VARIANT_HOMOGLYPH | IDN_VARIANT_SCRIPT_SWAP;
+        if (PG_NARGS() > 1 && !PG_ARGISNULL(1)) {
+            st->kinds = parse_text_arg_flags(PG_GETARG_TEXT_PP(1), SCOPE_VARIANT);
+        }
+
+        /* vary the UTS#46-mapped U-label form */
+        utf8_src = text_to_utf8(PG_GETARG_TEXT_PP(0), &utf8_srclen, &needs_free, true);
+        rc = op_uts46_lookup(utf8_src, &aform, 0);
+        if (needs_free) {
+            pfree(utf8_src);
+        }
+        if (rc == IDN2_OK) {
+            rc = op_idn2_to_unicode(aform, &uform, 0);
+            if (rc != IDN2_OK) {
+                free(aform);
+            }
+        }
+        if (rc != IDN2_OK) {
+            ereport(WARNING,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+                     errmsg_internal("Error encountered performing idn2 lookup: %s",
+                                     idn2_strerror(rc))));
+            MemoryContextSwitchTo(oldcontext);
+            SRF_RETURN_DONE(funcctx);
+        }
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(char *);
+        ctl.entrysize = sizeof(struct variant_entry);
+        ctl.hash = variant_entry_hash;
+        ctl.match = variant_entry_match;
+        ctl.hcxt = funcctx->multi_call_memory_ctx;
+        st->seen = hash_create("idn_variants names", 1024, &ctl,
+                               HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+        st->context = funcctx->multi_call_memory_ctx;
+        /* the name itself is not a variant */
+        variant_remember(st, aform);
+        free(aform);
+
+        dot = strchr(uform, '.');
+        st->rest = pstrdup(dot ? dot : "");
+        end = (const unsigned char *) (dot ? dot : uform + strlen(uform));
+        st->label = palloc(sizeof(pg_wchar) * (end - (const unsigned char *) uform + 1));
+        for (p = (const unsigned char *) uform; p < end; p += pg_utf_mblen(p)) {
+            st->label[st->len++] = utf8_to_unicode(p);
+        }
+        free(uform);
+        st->cand = palloc(sizeof(pg_wchar) * (st->len + 1));
+        initStringInfo(&st->buf);
+
+        funcctx->user_fctx = st;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    st = (struct variants_state *) funcctx->user_fctx;
+
+    while (st != NULL && variant_next(st)) {
+        char *dest = variant_convert(st);
+        Datum values[2];
+        bool nulls[2] = {false, false};
+        HeapTuple tuple;
+
+        if (dest == NULL) {
+            continue;
+        }
+        values[0] = PointerGetDatum(utf8_to_text(dest, strlen(dest)));
+        values[1] = CStringGetTextDatum(_variant_kinds[st->kind].name);
+        free(dest);
+
+        tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Email addresses (RFC 6530 / SMTPUTF8).
+ *
+ * idn_email_to_ascii and idn_email_to_unicode convert the domain of
+ * local@domain, split at the last '@', and leave the local part alone.
+ * The local part is never converted to UTF-8 and back: every server
+ * encoding is ASCII-safe, so '@' can be found in the database encoding
+ * and the local part copied as it is. The result is assembled in a
+ * single buffer, and an address whose domain needs no conversion is
+ * returned as it is.
+ */
+
+/* the converted address, or NULL with *rc set; *rc is IDN2_OK if the
+ * address has no '@'
+ */
+static text *
+email_convert(text *arg, bool to_unicode, int flags, int *rc)
+{
+    const char *src = VARDATA_ANY(arg);
+    size_t srclen = VARSIZE_ANY_EXHDR(arg);
+    const char *at = NULL, *domain;
+    size_t locallen, domainlen, utf8_domainlen, destlen;
+    char *utf8_domain, *dest;
+    bool palloced;
+    text *result;
+    size_t i;
+
+    for (i = srclen; i > 0; --i) {
+        if (src[i - 1] == '@') {
+            at = src + i - 1;
+            break;
+        }
+    }
+    if (at == NULL) {
+        *rc = IDN2_OK;
+        return NULL;
+    }
+    locallen = at - src;
+    domain = at + 1;
+    domainlen = srclen - locallen - 1;
+
+    /* nothing to convert */
+    if (to_unicode ? !has_alabel(domain, domainlen) : ascii_check((const uint8_t *) domain, domainlen)) {
+        *rc = IDN2_OK;
+        return arg;
+    }
+
+    utf8_domain = encoding_convert(&to_utf8_cache, GetDatabaseEncoding(), PG_UTF8,
+                                   domain, domainlen, &utf8_domainlen, &palloced);
+    if (utf8_domain == domain) {
+        utf8_domain = pnstrdup(domain, domainlen);
+        palloced = true;
+    }
+
+    if (!to_unicode) {
+        /* A-labels are ASCII, and so valid in any server encoding */
+        *rc = op_idn2_lookup(utf8_domain, &dest, flags);
+        if (palloced) {
+            pfree(utf8_domain);
+        }
+        if (*rc != IDN2_OK) {
+            return NULL;
+        }
+        destlen = strlen(dest);
+        result = palloc(VARHDRSZ + locallen + 1 + destlen);
+        memcpy(VARDATA(result) + locallen + 1, dest, destlen);
+        free(dest);
+    } else {
+        bool direct = (GetDatabaseEncoding() == PG_UTF8);
+        punycode_uint *ucs4 = palloc(sizeof(punycode_uint) * (utf8_domainlen + 1));
+
+        /* as for idn2_to_unicode, decode straight into the result in a
+         * UTF-8 database
+         */
+        if (direct) {
+            result = palloc(VARHDRSZ + locallen + 1 + TO_UNICODE_BUFSIZE(utf8_domainlen));
+            dest = VARDATA(result) + locallen + 1;
+        } else {
+            result = NULL;
+            dest = palloc(TO_UNICODE_BUFSIZE(utf8_domainlen));
+        }
+        *rc = to_unicode_name(utf8_domain, utf8_domainlen, dest, &destlen, ucs4, flags);
+        pfree(ucs4);
+        if (palloced) {
+            pfree(utf8_domain);
+        }
+        if (*rc != IDN2_OK) {
+            pfree(direct ? (void *) result : (void *) dest);
+            return NULL;
+        }
+        if (!direct) {
+            size_t convertedlen;
+            char *converted = encoding_convert(&from_utf8_cache, PG_UTF8, GetDatabaseEncoding(),
+                                               dest, destlen, &convertedlen, &palloced);
+
+            result = palloc(VARHDRSZ + locallen + 1 + convertedlen);
+            memcpy(VARDATA(result) + locallen + 1, converted, convertedlen);
+            if (palloced) {
+                pfree(converted);
+            }
+            pfree(dest);
+            destlen = convertedlen;
+        }
+    }
+
+    memcpy(VARDATA(result), src, locallen);
+    VARDATA(result)[locallen] = '@';
+    SET_VARSIZE(result, VARHDRSZ + locallen + 1 + destlen);
+    return result;
+}
+
+static Datum
+email_convert_scalar(FunctionCallInfo fcinfo, bool to_unicode)
+{
+    text *arg0, *result;
+    int flags = 0;
+    int rc;
+
+    switch (PG_NARGS()) {
+        case 2:
+            if (!PG_ARGISNULL(1)) {
+                flags = parse_text_arg_flags(PG_GETARG_TEXT_PP(1), SCOPE_IDNA2);
+            }
+        case 1:
+            if (PG_ARGISNULL(0)) {
+                PG_RETURN_NULL();
+            }
+            arg0 = PG_GETARG_TEXT_PP(0);
+            break;
+        default:
+            elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+
+    /* punycode_decode comes from libidn */
+    if (to_unicode) {
+        check_stringprep();
+    }
+
+    result = email_convert(arg0, to_unicode, flags, &rc);
+    if (result == NULL) {
+        if (rc == IDN2_OK) {
+            ereport(WARNING,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg_internal("Not an email address: no '@' found")));
+        } else {
+            ereport(WARNING,
+                    (errcode(ERRCODE_EXTERNAL_ROUTINE_INVOCATION_EXCEPTION),
+                     errmsg_internal("Error encountered performing idn2 %s: %s",
+                                     to_unicode ? "to-unicode conversion" : "lookup",
+                                     idn2_strerror(rc))));
+        }
+        PG_RETURN_NULL();
+    }
+    PG_RETURN_TEXT_P(result);
+}
+
+/* array forms: elements which fail to convert become NULL, quietly */
+static Datum
+email_convert_array(FunctionCallInfo fcinfo, bool to_unicode)
+{
+    ArrayType *arr;
+    Datum *elems;
+    bool *nulls;
+    int nelems, i, rc;
+    int flags = 0;
+
+    switch (PG_NARGS()) {
+        case 2:
+            if (!PG_ARGISNULL(1)) {
+                flags = parse_text_arg_flags(PG_GETARG_TEXT_PP(1), SCOPE_IDNA2);
+            }
+        case 1:
+            if (PG_ARGISNULL(0)) {
+                PG_RETURN_NULL();
+            }
+            arr = PG_GETARG_ARRAYTYPE_P(0);
+            break;
+        default:
+            elog(ERROR, "unexpected number of arguments: %d", PG_NARGS());
+    }
+
+    if (to_unicode) {
+        check_stringprep();
+    }
+
+    deconstruct_array(arr, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+    for (i = 0; i < nelems; ++i) {
+        text *res;
+
+        if (nulls[i]) {
+            continue;
+        }
+        res = email_convert(DatumGetTextPP(elems[i]), to_unicode, flags, &rc);
+        if (res == NULL) {
+            nulls[i] = true;
+        } else {
+            elems[i] = PointerGetDatum(res);
+        }
+    }
+
+    PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls, ARR_NDIM(arr), ARR_DIMS(arr), ARR_LBOUND(arr),
+                                             TEXTOID, -1, false, 'i'));
+}
+
+Datum idn_email_to_ascii(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_email_to_ascii);
+Datum idn_email_to_ascii(PG_FUNCTION_ARGS)
+{
+    return email_convert_scalar(fcinfo, false);
+}
+
+Datum idn_email_to_unicode(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_email_to_unicode);
+Datum idn_email_to_unicode(PG_FUNCTION_ARGS)
+{
+    return email_convert_scalar(fcinfo, true);
+}
+
+Datum idn_email_to_ascii_array(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_email_to_ascii_array);
+Datum idn_email_to_ascii_array(PG_FUNCTION_ARGS)
+{
+    return email_convert_array(fcinfo, false);
+}
+
+Datum idn_email_to_unicode_array(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(idn_email_to_unicode_array);
+Datum idn_email_to_unicode_array(PG_FUNCTION_ARGS)
+{
+    return email_convert_array(fcinfo, true);
+}
@@ -144,5 +144,222 @@ select stringprep(E'foo.bar.baz', 'trace');
 select stringprep(E'foo.bar.baz', 'trace', 'STRINGPREP_FLAG_NONE');
 select stringprep(E'foo\003.bar.baz', 'trace'); -- fail
 
--- TODO
+-- DNSSEC canonical ordering
+select idn_canonical_key('www.Example.COM.');
+select idn_canonical_key(u&'b\00fccher.de');
+-- the example from RFC 4034, section 6.1, plus a U-label
+select n from (values ('zABC.a.EXAMPLE'), ('z.example'), ('example'), ('*.z.example'), ('a.example'), (u&'\00fc.example'), ('Z.a.example'), ('yljkjljk.a.example')) as v(n) order by n using #<#;
+select 'WWW.Example.com.' #=# 'www.example.com';
+select u&'b\00fccher.de' #=# 'XN--BCHER-KVA.de';
+select u&'B\00dcCHER.de' #=# u&'b\00fccher.de';
+
+-- hashing on the canonical form
+select idn_hash('xn--bcher-kva.de', 0);
+select idn_hash('xn--bcher-kva.de');
+select count(distinct idn_hash(n, 42)) from (values (u&'b\00fccher.de'), (u&'B\00dcCHER.de'), (u&'B\00fccher.DE'), ('XN--BCHER-KVA.de'), ('xn--bcher-kva.de.')) as v(n);
+select idn_hash(u&'B\00dcCHER.de', 0) = idn_hash('xn--bcher-kva.de', 0);
+
+-- equivalent names land in the same hash partition
+create table idn_hash_part (n text) partition by hash (n idn_canonical_ops);
+create table idn_hash_part_0 partition of idn_hash_part for values with (modulus 2, remainder 0);
+create table idn_hash_part_1 partition of idn_hash_part for values with (modulus 2, remainder 1);
+insert into idn_hash_part values (u&'b\00fccher.de'), (u&'B\00dcCHER.de'), (u&'B\00fccher.DE'), ('XN--BCHER-KVA.de'), ('xn--bcher-kva.de.');
+select count(*) from idn_hash_part group by tableoid having count(*) = 5;
+drop table idn_hash_part;
+
+-- statement-level maintenance of derived columns
+create table idn_sync (name text, name_ascii text, name_unicode text);
+create trigger idn_sync_row after insert or update of name on idn_sync for each row execute procedure idn_sync_columns('name', 'name_ascii', 'idn2_lookup', 'name_unicode', 'idn_idna_decode:IDNA_FLAG_NONE');
+create trigger idn_sync after insert or update of name on idn_sync for each statement execute procedure idn_sync_columns('name', 'name_ascii', 'idn2_lookup', 'name_unicode', 'idn_idna_decode:IDNA_FLAG_NONE');
+insert into idn_sync (name) values ('bücher.de'), ('xn--bcher-kva.de'), ('foo.bar'), ('bücher.de');
+select name, name_ascii, name_unicode from idn_sync order by name, name_ascii;
+update idn_sync set name = 'xn--tda.example' where name = 'foo.bar';
+select name, name_ascii, name_unicode from idn_sync where name = 'xn--tda.example';
+update idn_sync set name = NULL where name = 'xn--tda.example';
+select name, name_ascii, name_unicode from idn_sync where name is null;
+drop trigger idn_sync_row on idn_sync;
+insert into idn_sync (name) values ('foo.bar');
+drop table idn_sync;
+
+-- structural classification
+select n, idn_classify(n) from (values ('example.com'), ('example.com.'), ('XN--BCHER-KVA.de'), ('bücher.de'), ('_dmarc.example.com'), ('a..b'), ('')) as v(n);
+select idn_classify(repeat('a', 64) || '.com');
+select idn_classify(repeat('abcdefghi.', 26) || 'com') & value <> 0 from idn_constants() where name = 'IDN_CLASS_INVALID';
+
+-- streaming conversion of a server-side file
+-- (relative paths are in the data directory, so nothing depends on the client's file system)
+copy (select n from (values ('bücher.de'), ('foo.bar'), (u&'\221a.com'), ('')) as v(n)) to program 'cat > idn_convert_file.txt' with (encoding 'UTF8');
+select * from idn_convert_file('idn_convert_file.txt', 'idn2_lookup');
+select line_no, output from idn_convert_file('idn_convert_file.txt', 'idn_idna_encode', 'IDNA_FLAG_NONE') where line_no = 1;
+copy (select 1 where false) to program 'rm -f idn_convert_file.txt';
+
 -- UTS46 tests
+-- (ÖBB.at), disallowed by plain IDNA2008, is mapped
+select idn_uts46_lookup(u&'\00d6BB.at');
+select idn2_lookup(u&'\00d6BB.at', 'IDN2_FLAG_NONTRANSITIONAL');
+-- (faß.de), a deviation character
+select idn_uts46_lookup(u&'fa\00df.de');
+select idn_uts46_lookup(u&'fa\00df.de', 'UTS46_FLAG_NONTRANSITIONAL');
+select idn_uts46_lookup(u&'fa\00df.de', 'UTS46_FLAG_TRANSITIONAL');
+-- (√.com), only transitional processing allows it
+select idn_uts46_lookup(u&'\221a.com', 'UTS46_FLAG_TRANSITIONAL');
+select idn_uts46_lookup(u&'\221a.com'); -- fails
+
+-- IDNA2008 to-Unicode
+select idn2_to_unicode('xn--bcher-kva.de');
+select idn2_to_unicode('WWW.XN--BCHER-KVA.de.');
+-- labels without the ACE prefix are left alone
+select idn2_to_unicode(u&'Foo.B\00fccher.xn--tda');
+select idn2_to_unicode('xn--19g.com'); -- fails, not a valid U-label
+select idn2_to_unicode('xn--.com'); -- fails
+
+-- parallel safety
+-- only the trigger, the file reader and the backfill functions should be missing here
+select p.proname, p.proparallel from pg_proc p join pg_depend d on d.classid = 'pg_proc'::regclass and d.objid = p.oid join pg_extension e on e.oid = d.refobjid where e.extname = 'idn' and p.proparallel <> 's' order by 1;
+create table idn_parallel as select 'name' || g || '.example' as n from generate_series(1, 1000) as g;
+insert into idn_parallel values (u&'b\00fccher.de');
+analyze idn_parallel;
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+set min_parallel_table_scan_size = 0;
+set max_parallel_workers_per_gather = 2;
+explain (costs off) select count(idn2_lookup(n)) from idn_parallel;
+select count(idn2_lookup(n)), count(distinct idn_hash(n, 0)) from idn_parallel where idn_classify(n) & 8 = 0;
+reset parallel_setup_cost;
+reset parallel_tuple_cost;
+reset min_parallel_table_scan_size;
+reset max_parallel_workers_per_gather;
+drop table idn_parallel;
+
+-- validation summary
+-- (√.com) fails IDNA2008, (ｅｘａｍｐｌｅ.com) passes IDNA2003 but not plain IDNA2008 and is not NFKC-stable
+select idn_validation_summary(n) from (values ('example.com'), (u&'b\00fccher.de'), (u&'\221a.com'), (u&'\ff45\ff58\ff41\ff4d\ff50\ff4c\ff45.com'), (NULL)) as v(n);
+select idn_validation_summary(n, 'IDN_CHECK_IDNA2008_LOOKUP|IDN_CHECK_NFKC') from (values ('example.com'), (u&'b\00fccher.de'), (u&'\221a.com'), (u&'\ff45\ff58\ff41\ff4d\ff50\ff4c\ff45.com'), (NULL)) as v(n);
+select idn_validation_summary(n, 'IDN_CHECK_IDNA2008_REGISTER') from (values ('example.com.'), (u&'b\00fccher.de.')) as v(n);
+select idn_validation_summary(n) from (values ('example.com')) as v(n) where false;
+create table idn_parallel as select 'name' || g || '.example' as n from generate_series(1, 1000) as g;
+insert into idn_parallel values (u&'\221a.com');
+analyze idn_parallel;
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+set min_parallel_table_scan_size = 0;
+set max_parallel_workers_per_gather = 2;
+explain (costs off) select idn_validation_summary(n, 'IDN_CHECK_IDNA2008_LOOKUP') from idn_parallel;
+select idn_validation_summary(n, 'IDN_CHECK_IDNA2008_LOOKUP') from idn_parallel;
+reset parallel_setup_cost;
+reset parallel_tuple_cost;
+reset min_parallel_table_scan_size;
+reset max_parallel_workers_per_gather;
+drop table idn_parallel;
+
+-- approximate distinct counts
+select idn_approx_distinct(n) from (values ('example.com'), ('EXAMPLE.COM.'), (u&'b\00fccher.de'), ('xn--bcher-kva.de'), ('foo.bar'), (NULL)) as v(n);
+select idn_approx_distinct('name' || (g % 5000) || '.example') from generate_series(1, 20000) as g;
+-- per-day sketches roll up to the same estimate
+select idn_hll_cardinality(idn_hll_merge(s)), count(*) from (select idn_hll_sketch('name' || (g % 5000) || '.example') as s from generate_series(1, 20000) as g group by g % 7) as daily;
+select idn_hll_cardinality(idn_hll_union(idn_hll_add(NULL, 'example.com'), idn_hll_add(NULL, u&'b\00fccher.de')));
+select octet_length(idn_hll_sketch(n)) from (values ('example.com')) as v(n);
+select idn_approx_distinct(n), idn_hll_sketch(n) is null from (values ('example.com')) as v(n) where false;
+select idn_hll_cardinality('\x0102'::bytea); -- fails
+create table idn_parallel as select 'name' || g || '.example' as n from generate_series(1, 1000) as g;
+insert into idn_parallel values (u&'b\00fccher.de');
+analyze idn_parallel;
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+set min_parallel_table_scan_size = 0;
+set max_parallel_workers_per_gather = 2;
+explain (costs off) select idn_approx_distinct(n) from idn_parallel;
+select idn_approx_distinct(n) from idn_parallel;
+reset parallel_setup_cost;
+reset parallel_tuple_cost;
+reset min_parallel_table_scan_size;
+reset max_parallel_workers_per_gather;
+drop table idn_parallel;
+
+-- background backfill
+-- a worker only starts once its job commits, so the job table is tested here without one
+create table idn_backfill (name text, name_ascii text);
+insert into idn_backfill values (u&'b\00fccher.de'), (u&'\221a.com'), (NULL);
+begin;
+select idn_backfill_start('idn_backfill', 'name', 'name_ascii', batch_pages => 1, batch_delay_ms => 0) > 0 as started;
+select status, blocks_done, total_blocks, percent_done, rows_updated, rows_failed, error from idn_backfill_progress;
+select idn_backfill_cancel(job_id) from idn_backfill_jobs;
+select status, finished_at is not null as finished from idn_backfill_jobs;
+select idn_backfill_cancel(job_id) from idn_backfill_jobs; -- already cancelled
+select idn_backfill_resume(job_id) from idn_backfill_jobs;
+select status, finished_at is not null as finished from idn_backfill_jobs;
+-- a running job whose worker has gone away can be resumed
+update idn_backfill_jobs set status = 'running', worker_pid = 0;
+select status from idn_backfill_progress;
+select idn_backfill_resume(job_id) from idn_backfill_jobs;
+-- so can a failed one, which loses its error
+update idn_backfill_jobs set status = 'failed', error = 'oops', finished_at = now();
+select idn_backfill_resume(job_id) from idn_backfill_jobs;
+select status, error, finished_at is not null as finished from idn_backfill_jobs;
+-- a finished job can be neither resumed nor cancelled
+update idn_backfill_jobs set status = 'done', finished_at = now();
+select idn_backfill_resume(job_id), idn_backfill_cancel(job_id) from idn_backfill_jobs;
+select percent_done from idn_backfill_progress;
+rollback;
+-- the job's INSERT is rolled back, and no worker is started for it
+select count(*) from idn_backfill_jobs;
+select idn_backfill_resume(0); -- fails
+select idn_backfill_start('idn_backfill', 'nope', 'name_ascii'); -- fails
+select idn_backfill_start('idn_backfill', 'name', 'name_ascii', 'nope'); -- fails
+-- a job queued in a rolled-back savepoint is dropped with it
+begin;
+savepoint s;
+select idn_backfill_start('idn_backfill', 'name', 'name_ascii', batch_pages => 1, batch_delay_ms => 0) > 0 as started;
+rollback to savepoint s;
+commit;
+select count(*) from idn_backfill_jobs;
+-- run a job to completion; a NULL source gets a NULL target
+update idn_backfill set name_ascii = 'stale.example' where name is null;
+select idn_backfill_start('idn_backfill', 'name', 'name_ascii', batch_pages => 1, batch_delay_ms => 0) > 0 as started;
+do $$
+begin
+    for i in 1..600 loop
+        exit when (select status from idn_backfill_jobs) in ('done', 'failed');
+        perform pg_sleep(0.1);
+    end loop;
+end
+$$;
+select status, blocks_done, total_blocks, percent_done, rows_updated, rows_failed, error from idn_backfill_progress;
+select name, name_ascii from idn_backfill where name is null or name_ascii is not null order by name;
+delete from idn_backfill_jobs;
+drop table idn_backfill;
+
+-- brand matching
+select n, idn_brand_match(n, array['paypal', u&'b\00fccher', 'xn--', NULL, '', 'bank']) from (values ('PayPal-login.com'), ('XN--BCHER-KVA.de'), (u&'b\00fccher-bank.de'), ('example.com'), (u&'\221a.paypal.com'), (u&'\ff30\ff21\ff39\ff30\ff21\ff2c.com')) as v(n);
+select idn_brand_match('paypal.bank', '[0:1]={bank,paypal}'::text[]);
+select idn_brand_match('paypal.com', '{}'::text[]);
+select idn_brand_match('paypal.com', '{{paypal},{bank}}'::text[]); -- fails
+
+-- typosquatting candidates
+select * from idn_variants('paypal.com', 'IDN_VARIANT_TRANSPOSITION');
+select variant, kind, idn2_to_unicode(variant) from idn_variants('PayPal.com', 'IDN_VARIANT_HOMOGLYPH|IDN_VARIANT_SCRIPT_SWAP');
+select kind, count(*) from idn_variants('paypal.com') group by kind order by kind;
+select * from idn_variants(u&'g\043e\043egle.com', 'IDN_VARIANT_SCRIPT_SWAP');
+select * from idn_variants('a.com', 'IDN_VARIANT_OMISSION');
+select count(*) from idn_variants(NULL);
+select count(*) from idn_variants(u&'\221a.com');
+select * from idn_variants('paypal.com', 'nope'); -- fails
+
+-- email addresses
+select idn_email_to_ascii(u&'j\00f6rg@b\00fccher.de');
+select idn_email_to_ascii('"a@b"@example.com');
+select idn_email_to_ascii(u&'"a@b"@b\00fccher.de');
+select idn_email_to_unicode(u&'j\00f6rg@xn--bcher-kva.de');
+select idn_email_to_unicode('user@example.com');
+select idn_email_to_ascii('example.com');
+select idn_email_to_ascii(u&'x@\221a.com');
+select idn_email_to_ascii(array[u&'j\00f6rg@b\00fccher.de', 'example.com', NULL, u&'x@\221a.com', 'a@example.com']);
+select idn_email_to_unicode(array['a@xn--bcher-kva.de', 'b@example.com']);
+
+-- upgrading from 0.2
+drop extension idn;
+create extension idn version '0.2';
+alter extension idn update;
+select extversion from pg_extension where extname = 'idn';
+select proparallel, procost from pg_proc where proname = 'idn2_lookup';
+select idn_canonical_key(u&'b\00fccher.de');
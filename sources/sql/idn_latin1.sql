@@ -0,0 +1,24 @@
+-- a LATIN1 database, where arguments and results are converted
+-- creating it needs CREATEDB; without that, only the \else branch runs (idn_latin1_1.out)
+select rolsuper or rolcreatedb as can_create from pg_roles where rolname = current_user \gset
+\if :can_create
+select current_database() as regress_db \gset
+create database idn_latin1 encoding 'LATIN1' lc_collate 'C' lc_ctype 'C' template template0;
+\c idn_latin1
+set client_encoding = 'UTF8';
+create extension idn;
+select idn2_lookup('bücher.de');
+select idn2_to_unicode('xn--bcher-kva.de');
+select idn2_to_unicode(idn2_lookup('jörg.bücher.de')) = 'jörg.bücher.de' as round_trip;
+select idn_email_to_ascii('jörg@bücher.de');
+select idn_email_to_unicode('jörg@xn--bcher-kva.de');
+select idn_email_to_ascii(array['jörg@bücher.de', 'a@example.com']);
+-- too large for the kept conversion buffers
+select length(idn_utf8_nfkc_normalize(repeat('ö', 40000)));
+-- (ԛәлп.com) has no LATIN1 form
+select idn2_to_unicode('xn--k1ai47bhi.com'); -- fails
+\c :regress_db
+drop database idn_latin1;
+\else
+\echo skipped: the current role cannot create databases
+\endif